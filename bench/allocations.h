@@ -0,0 +1,33 @@
+/*  Heap allocation counting shared by the benchmarks.
+ *
+ *  Replaces the global operator new so that every heap allocation made by the program
+ *  increments allocations.
+ *  Include it in one translation unit only.
+ */
+#ifndef PJAC_BENCH_ALLOCATIONS_H
+#define PJAC_BENCH_ALLOCATIONS_H
+
+#include <cstdlib>
+#include <new>
+
+
+// the replaced operators below pair malloc() with free(), which GCC cannot see through
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+static unsigned long allocations = 0;
+
+void* operator new(std::size_t size) {
+    ++allocations;
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+#endif
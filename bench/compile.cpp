@@ -0,0 +1,79 @@
+/*  Allocation benchmark of function compilation.
+ *
+ *  Compiles a generated source of many functions with nested blocks, calls and temporaries
+ *  and reports time and number of heap allocations per compiled function.
+ *  Lexing and normalization are done before measuring; only processSource() is counted.
+ *  Heap allocations are counted by replacing the global operator new.
+ *
+ *  Usage: ./build/bench/compile [<source_file>]
+ */
+#define PJAC_NO_MAIN
+#include "../src/main.cpp"
+#include <chrono>
+#include "allocations.h"
+
+
+string generateSource(unsigned functions) {
+    ostringstream oss;
+    oss << "function id(auto value) -> auto { return value; }\n";
+    oss << "function pair(auto first, auto second) -> int { return 0; }\n";
+    for (unsigned n = 0; n < functions; ++n) {
+        oss << "function generated_" << n << "(int counter, bool flag) -> int {\n";
+        oss << "    var int total = " << n << ";\n";
+        oss << "    var string label = \"function " << n << "\";\n";
+        oss << "    while flag {\n";
+        oss << "        var int step = 1;\n";
+        oss << "        if flag {\n";
+        oss << "            var auto copy = total;\n";
+        oss << "            pair(copy, 42);\n";
+        oss << "            total = id(step);\n";
+        oss << "        } ;\n";
+        oss << "        {\n";
+        oss << "            var bool done = true;\n";
+        oss << "            flag = id(done);\n";
+        oss << "        } ;\n";
+        oss << "        pair(label, \"literal\");\n";
+        oss << "    } ;\n";
+        oss << "    return total;\n";
+        oss << "}\n";
+    }
+    oss << "function main() -> int { return 0; }\n";
+    return oss.str();
+}
+
+int benchmark(const string& name, const string& source) {
+    Interner symbols;
+    auto tokens = normalize(support::str::lex(source.data(), source.size(), symbols));
+
+    ostringstream output;
+    unsigned long allocations_before = allocations;
+    auto begin = chrono::steady_clock::now();
+    try {
+        processSource(tokens, output);
+    } catch (const InvalidSyntax& e) {
+        cout << name << ": failed to compile: " << e.what() << endl;
+        return 1;
+    }
+    auto end = chrono::steady_clock::now();
+    unsigned long allocated = (allocations - allocations_before);
+
+    string compiled = output.str();
+    string::size_type functions = 0;
+    for (auto at = compiled.find(".function:"); at != string::npos; at = compiled.find(".function:", (at + 1))) {
+        ++functions;
+    }
+    functions = max(functions, string::size_type{1});
+
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+    cout << name << ": " << functions << " functions, ";
+    cout << (static_cast<double>(ns) / static_cast<double>(functions)) << " ns/function, ";
+    cout << (static_cast<double>(allocated) / static_cast<double>(functions)) << " allocations/function" << endl;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        return benchmark(argv[1], support::io::readfile(argv[1]));
+    }
+    return benchmark("generated", generateSource(20000));
+}
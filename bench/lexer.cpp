@@ -0,0 +1,199 @@
+/*  Lexer throughput benchmark.
+ *
+ *  Compares the table-driven lexer with the original per-character switch lexer that
+ *  accumulated tokens in an ostringstream.
+ *
+ *  Usage: ./build/bench/lexer [<source_file>]
+ *  Without a file, two synthetic sources are generated: about 16MB of code, and a smaller
+ *  source dense with string literals (the original lexer copied the rest of the input for every
+ *  literal so it is quadratic there).
+ */
+#define PJAC_NO_MAIN
+#include "../src/main.cpp"
+#include <chrono>
+
+
+namespace legacy {
+    struct Token {
+        string token_string;
+        string::size_type line_number;
+        string::size_type character_number;
+        string::size_type byte_number;
+
+        Token(const string& s, string::size_type ln, string::size_type cn, string::size_type bn):
+            token_string(s), line_number(ln), character_number(cn), byte_number(bn) {}
+    };
+
+    Token getToken(ostringstream& t, string::size_type line_no, string::size_type char_no, string::size_type byte_no) {
+        string tok = t.str();
+        return Token(tok, line_no, (char_no - tok.size()), (byte_no - tok.size()));
+    }
+    Token getToken(const string& tok, string::size_type line_no, string::size_type char_no, string::size_type byte_no) {
+        return Token(tok, line_no, (char_no - tok.size()), (byte_no - tok.size()));
+    }
+
+    vector<Token> lex(const string& s) {
+        vector<Token> tokens;
+        ostringstream token;
+        string::size_type i = 0;
+
+        string::size_type line_no = 0;
+        string::size_type byte_no = 0;
+        string::size_type char_no = 0;
+
+        char c;
+        string tk;
+        while (i < s.size()) {
+            c = s[i];
+            switch (c) {
+                case ' ':
+                case '\t':
+                    if (token.str().size() != 0) {
+                        tokens.push_back(getToken(token, line_no, char_no, byte_no));
+                        token.str("");
+                    }
+                    break;
+                case '\n':
+                case '(':
+                case ')':
+                case '[':
+                case ']':
+                case '{':
+                case '}':
+                case '<':
+                case '>':
+                case '~':
+                case '!':
+                case '@':
+                case '#':
+                case '$':
+                case '%':
+                case '^':
+                case '&':
+                case '*':
+                case '-':
+                case '+':
+                case '=':
+                case '|':
+                case '\\':
+                case ':':
+                case ';':
+                case ',':
+                case '.':
+                case '?':
+                case '/':
+                    if (token.str().size() != 0) {
+                        tokens.push_back(getToken(token, line_no, char_no, byte_no));
+                        token.str("");
+                    }
+                    token << c;
+                    tokens.push_back(getToken(token, line_no, char_no, byte_no));
+                    token.str("");
+                    if (c == '\n') {
+                        ++line_no;
+                        char_no = 0;
+                    }
+                    break;
+                case '"':
+                case '\'':
+                    if (token.str().size() != 0) {
+                        tokens.push_back(getToken(token, line_no, char_no, byte_no));
+                        token.str("");
+                    }
+                    tk = support::str::extract(s.substr(i));
+                    i += (tk.size()-1);
+                    tokens.push_back(getToken(tk, line_no, char_no, byte_no));
+                    break;
+                default:
+                    token << c;
+                    break;
+            }
+            ++byte_no;
+            ++char_no;
+            ++i;
+        }
+
+        if (token.str().size()) {
+            tokens.push_back(getToken(token, line_no, char_no, byte_no));
+        }
+
+        return tokens;
+    }
+}
+
+
+string generateSource(string::size_type size, bool literals) {
+    ostringstream oss;
+    unsigned n = 0;
+    while (static_cast<string::size_type>(oss.tellp()) < size) {
+        if (literals) {
+            oss << "print(\"literal number " << n << " with \\\"escaped\\\" quotes\");\n";
+            oss << "var string s" << n << " = 'single quoted';\n";
+            ++n;
+            continue;
+        }
+        oss << "// generated function number " << n << "\n";
+        oss << "function generated_" << n << "(int counter, auto message) -> int {\n";
+        oss << "    var int limit = " << n << ";\n";
+        oss << "    var float ratio = " << n << ".25;\n";
+        oss << "    /* loop over the counter */\n";
+        oss << "    while counter { counter = decrement(counter); if limit { print(message); } }\n";
+        oss << "    return counter;\n";
+        oss << "}\n";
+        ++n;
+    }
+    return oss.str();
+}
+
+template<typename Fn> double measure(Fn fn, unsigned rounds) {
+    auto best = chrono::duration<double>::max();
+    for (unsigned i = 0; i < rounds; ++i) {
+        auto begin = chrono::steady_clock::now();
+        fn();
+        auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin);
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best.count();
+}
+
+void report(const string& name, string::size_type tokens, string::size_type bytes, double seconds) {
+    cout << name << ": " << tokens << " tokens in " << seconds << "s, ";
+    cout << (static_cast<double>(tokens) / seconds / 1e6) << " Mtokens/s, ";
+    cout << (static_cast<double>(bytes) / seconds / 1e6) << " MB/s" << endl;
+}
+
+int benchmark(const string& name, const string& source) {
+    const unsigned rounds = 3;
+
+    cout << name << " (" << source.size() << " bytes)" << endl;
+
+    string::size_type legacy_count = 0;
+    double legacy_time = measure([&]() { legacy_count = legacy::lex(source).size(); }, rounds);
+    report("  legacy switch lexer", legacy_count, source.size(), legacy_time);
+
+    string::size_type table_count = 0;
+    Interner symbols;
+    double table_time = measure([&]() { table_count = support::str::lex(source.data(), source.size(), symbols).size(); }, rounds);
+    report("  table-driven lexer ", table_count, source.size(), table_time);
+
+    if (legacy_count != table_count) {
+        cout << "error: token count mismatch" << endl;
+        return 1;
+    }
+    cout << "  speedup: " << (legacy_time / table_time) << "x" << endl;
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        return benchmark(argv[1], support::io::readfile(argv[1]));
+    }
+
+    int result = 0;
+    result |= benchmark("code", generateSource(16 * 1024 * 1024, false));
+    result |= benchmark("string literals", generateSource(512 * 1024, true));
+    return result;
+}
@@ -0,0 +1,74 @@
+/*  Stress benchmark of deeply nested blocks.
+ *
+ *  Compiles functions whose bodies are nested while-, if- and bare blocks, each time
+ *  with twice as deep nesting as before, and reports time per level of nesting.
+ *  Time per level should stay flat as nesting gets deeper.
+ *
+ *  Usage: ./build/bench/nesting [<max_depth>]
+ */
+#define PJAC_NO_MAIN
+#include "../src/main.cpp"
+#include <chrono>
+
+
+string generateSource(unsigned depth) {
+    ostringstream oss;
+    oss << "function nested() -> int {\n";
+    oss << "    var bool flag = true;\n";
+    for (unsigned n = 0; n < depth; ++n) {
+        switch (n % 3) {
+            case 0:
+                oss << "while flag {\n";
+                break;
+            case 1:
+                oss << "if flag {\n";
+                break;
+            default:
+                oss << "{\n";
+        }
+    }
+    oss << "var int innermost = " << depth << ";\n";
+    for (unsigned n = depth; n > 0; --n) {
+        // bare blocks are followed by a token that is skipped after their closing "}"
+        oss << (((n - 1) % 3) == 2 ? "} ;\n" : "}\n");
+    }
+    oss << "    return 0;\n";
+    oss << "}\n";
+    oss << "function main() -> int { return 0; }\n";
+    return oss.str();
+}
+
+int benchmark(unsigned depth) {
+    string source = generateSource(depth);
+    Interner symbols;
+    auto tokens = normalize(support::str::lex(source.data(), source.size(), symbols));
+
+    ostringstream output;
+    auto begin = chrono::steady_clock::now();
+    try {
+        processSource(tokens, output);
+    } catch (const InvalidSyntax& e) {
+        cout << "depth " << depth << ": failed to compile: " << e.what() << endl;
+        return 1;
+    }
+    auto end = chrono::steady_clock::now();
+
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+    cout << "depth " << depth << ": ";
+    cout << (static_cast<double>(ns) / 1000000.0) << " ms, ";
+    cout << (static_cast<double>(ns) / static_cast<double>(depth)) << " ns/level" << endl;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned max_depth = 256000;
+    if (argc > 1) {
+        max_depth = static_cast<unsigned>(stoul(argv[1]));
+    }
+    for (unsigned depth = 1000; depth <= max_depth; depth *= 2) {
+        if (int result = benchmark(depth)) {
+            return result;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,297 @@
+/*  Allocation benchmark of the support::str helpers.
+ *
+ *  Compares the view-based helpers with the original ones that built every result
+ *  in a freshly allocated string (often through an ostringstream).
+ *  Heap allocations are counted by replacing the global operator new; results of both
+ *  implementations are checked to be equal.
+ *
+ *  Usage: ./build/bench/str
+ */
+#define PJAC_NO_MAIN
+#include "../src/main.cpp"
+#include <chrono>
+#include "allocations.h"
+
+
+namespace legacy {
+    string sub(const string& s, long unsigned b = 0, long int e = -1) {
+        /*  Returns substring of s.
+         *  If only s is passed, returns copy of s.
+         */
+        if (b == 0 and e == -1) return string(s);
+
+        ostringstream part;
+        part.str("");
+
+        long unsigned end;
+        if (e < 0) { end = (s.size() + e + 1); }
+        else { end = static_cast<long unsigned>(e); }
+
+        for (long unsigned i = b; i < s.size() and i < end; ++i) {
+            part << s[i];
+        }
+
+        return part.str();
+    }
+
+    string lstrip(const string& s) {
+        /*  Removes whitespace from left side of the string.
+         */
+        unsigned i = 0;
+        while (i < s.size()) {
+            if (not (s[i] == ' ' or s[i] == '\t' or s[i] == '\v' or s[i] == '\n')) {
+                break;
+            };
+            ++i;
+        }
+        return sub(s, i);
+    }
+
+    string chunk(const string& s, bool ignore_leading_ws = true) {
+        /*  Returns part of the string until first whitespace from left side.
+         */
+        ostringstream chnk;
+
+        string str = (ignore_leading_ws ? lstrip(s) : s);
+
+        for (unsigned i = 0; i < str.size(); ++i) {
+            if (str[i] == *" " or str[i] == *"\t" or str[i] == *"\v" or str[i] == *"\n") break;
+            chnk << str[i];
+        }
+        return chnk.str();
+    }
+
+    bool startswithchunk(const std::string& s, const std::string& w) {
+        /*  Returns true if s stars with chunk w.
+         */
+        return (chunk(s) == w);
+    }
+
+    bool endswith(const std::string& s, const std::string& w) {
+        /*  Returns true if s ends with w.
+         */
+        return (s.compare(s.length()-w.length(), s.length(), w) == 0);
+    }
+
+    bool isnum(const std::string& s, bool negatives = true) {
+        /*  Returns true if s contains only numerical characters.
+         *  Regex equivalent: `^[0-9]+$`
+         */
+        bool num = false;
+        unsigned start = 0;
+        if (s[0] == '-' and negatives) {
+            // must handle negative numbers
+            start = 1;
+        }
+        for (unsigned i = start; i < s.size(); ++i) {
+            switch (s[i]) {
+                case '0':
+                case '1':
+                case '2':
+                case '3':
+                case '4':
+                case '5':
+                case '6':
+                case '7':
+                case '8':
+                case '9':
+                    num = true;
+                    break;
+                default:
+                    num = false;
+            }
+            if (!num) break;
+        }
+        return num;
+    }
+
+    bool isalpha(const std::string& s) {
+        /** Returns true if s contains only letters.
+         */
+        bool is_alpha = true;
+        for (std::string::size_type i = 0; i < s.size(); ++i) {
+            if (not ((s[i] >= 'A' and s[i] <= 'Z') or (s[i] >= 'a' and s[i] <= 'z'))) {
+                is_alpha = false;
+                break;
+            }
+        }
+        return is_alpha;
+    }
+
+    bool isname(const std::string& s) {
+        /** Returns true if s is a valid name.
+         */
+        if (s.size() == 0) {
+            return false;
+        }
+        if (not isalpha(s.substr(0, 1))) {
+            return false;
+        }
+        bool is_name = true;
+        for (std::string::size_type i = 1; i < s.size(); ++i) {
+            if (not ((s[i] >= 'A' and s[i] <= 'Z') or (s[i] >= 'a' and s[i] <= 'z') or (s[i] >= '0' and s[i] <= '9') or s[i] == '_')) {
+                is_name = false;
+                break;
+            }
+        }
+        return is_name;
+    }
+
+    bool isfloat(const std::string& s, bool negatives = true) {
+        /*  Returns true if s contains only numerical characters.
+         *  Regex equivalent: `^[0-9]+\.[0-9]+$`
+         */
+        bool is = false;
+        unsigned start = 0;
+        if (s[0] == '-' and negatives) {
+            // to handle negative numbers
+            start = 1;
+        }
+        int dot = -1;
+        for (unsigned i = start; i < s.size(); ++i) {
+            if (s[i] == '.') {
+                dot = static_cast<int>(i);
+                break;
+            }
+        }
+        is = isnum(sub(s, 0, dot), negatives) and isnum(sub(s, (static_cast<unsigned>(dot)+1)));
+        return is;
+    }
+
+    bool isbooleanliteral(const string& s) {
+        return (s == "true" or s == "false");
+    }
+
+    vector<string> chunks(const string& s) {
+        /*  Returns chunks of string.
+         */
+        vector<string> chnks;
+        string tmp(lstrip(s));
+        string chnk;
+        while (tmp.size()) {
+            chnk = chunk(tmp);
+            tmp = lstrip(sub(tmp, chnk.size()));
+            chnks.push_back(chnk);
+        }
+        return chnks;
+    }
+
+    string join(const string& s, const vector<string>& parts) {
+        /** Join elements of vector with given string.
+         */
+        ostringstream oss;
+        long unsigned limit = parts.size();
+        for (long unsigned i = 0; i < limit; ++i) {
+            oss << parts[i];
+            if (i < (limit-1)) {
+                oss << s;
+            }
+        }
+        return oss.str();
+    }
+}
+
+
+const vector<string> inputs = {
+    "3.14159265358979",
+    "-1234567890.0987654321",
+    "identifier_with_a_rather_long_name",
+    "    leading whitespace before the first chunk of a line",
+    "var int counter = 42 ; while counter { counter = decrement ( counter ) ; }",
+    "12345678901234567890",
+    "not-a-number",
+};
+
+template<typename Fn> double measure(Fn fn, unsigned rounds) {
+    auto best = chrono::duration<double>::max();
+    for (unsigned i = 0; i < rounds; ++i) {
+        auto begin = chrono::steady_clock::now();
+        fn();
+        auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin);
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best.count();
+}
+
+template<typename Fn> void report(const string& name, Fn fn) {
+    /*  Reports time and heap allocations per call of fn on every input.
+     */
+    const unsigned calls = 200000;
+    unsigned long sink = 0;
+
+    unsigned long before = allocations;
+    double seconds = measure([&]() {
+        for (unsigned i = 0; i < calls; ++i) {
+            sink += fn(inputs[i % inputs.size()]);
+        }
+    }, 3);
+    double per_call = (static_cast<double>(allocations - before) / (3.0 * calls));
+
+    cout << "  " << name << ": " << (seconds / calls * 1e9) << " ns/call, " << per_call << " allocations/call";
+    cout << (sink == 0 ? " " : "") << endl;
+}
+
+string str(string_view s) {
+    return string(s);
+}
+vector<string> strs(const vector<string_view>& v) {
+    return vector<string>(v.begin(), v.end());
+}
+
+int verify() {
+    /*  Both implementations must give the same results.
+     */
+    for (const auto& each : inputs) {
+        bool same = true;
+        same = same and (legacy::sub(each, 2, 9) == str(support::str::sub(each, 2, 9)));
+        same = same and (legacy::sub(each, 3) == str(support::str::sub(each, 3)));
+        same = same and (legacy::sub(each, 1, -3) == str(support::str::sub(each, 1, -3)));
+        same = same and (legacy::sub(each, 40, 20) == str(support::str::sub(each, 40, 20)));
+        same = same and (legacy::lstrip(each) == str(support::str::lstrip(each)));
+        same = same and (legacy::chunk(each) == str(support::str::chunk(each)));
+        same = same and (legacy::chunk(each, false) == str(support::str::chunk(each, false)));
+        same = same and (legacy::chunks(each) == strs(support::str::chunks(each)));
+        same = same and (legacy::isnum(each) == support::str::isnum(each));
+        same = same and (legacy::isname(each) == support::str::isname(each));
+        same = same and (legacy::isfloat(each) == support::str::isfloat(each));
+        same = same and (legacy::isfloat(each, false) == support::str::isfloat(each, false));
+        same = same and (legacy::join(", ", legacy::chunks(each)) == support::str::join(", ", support::str::chunks(each)));
+        if (not same) {
+            cout << "error: results differ for input: " << each << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main() {
+    if (verify() != 0) {
+        return 1;
+    }
+
+    cout << "legacy helpers" << endl;
+    report("sub     ", [](const string& s) { return legacy::sub(s, 2, 12).size(); });
+    report("lstrip  ", [](const string& s) { return legacy::lstrip(s).size(); });
+    report("chunk   ", [](const string& s) { return legacy::chunk(s).size(); });
+    report("chunks  ", [](const string& s) { return legacy::chunks(s).size(); });
+    report("isnum   ", [](const string& s) { return static_cast<size_t>(legacy::isnum(s)); });
+    report("isname  ", [](const string& s) { return static_cast<size_t>(legacy::isname(s)); });
+    report("isfloat ", [](const string& s) { return static_cast<size_t>(legacy::isfloat(s)); });
+    vector<string> legacy_parts = legacy::chunks(inputs[4]);
+    report("join    ", [&](const string&) { return legacy::join(" ", legacy_parts).size(); });
+
+    cout << "view helpers" << endl;
+    report("sub     ", [](const string& s) { return support::str::sub(s, 2, 12).size(); });
+    report("lstrip  ", [](const string& s) { return support::str::lstrip(s).size(); });
+    report("chunk   ", [](const string& s) { return support::str::chunk(s).size(); });
+    report("chunks  ", [](const string& s) { return support::str::chunks(s).size(); });
+    report("isnum   ", [](const string& s) { return static_cast<size_t>(support::str::isnum(s)); });
+    report("isname  ", [](const string& s) { return static_cast<size_t>(support::str::isname(s)); });
+    report("isfloat ", [](const string& s) { return static_cast<size_t>(support::str::isfloat(s)); });
+    vector<string_view> parts = support::str::chunks(inputs[4]);
+    report("join    ", [&](const string&) { return support::str::join(" ", parts).size(); });
+
+    return 0;
+}
@@ -0,0 +1,20 @@
+// functions made only of inline assembly are compiled into their call sites (see "Optimisation" in README)
+function print(auto msg) { asm print msg; }
+function decrement(int a) -> int { asm idec a; return a; }
+
+// literals returned by inlined functions are stored in the variable the result is assigned to
+function five(int a) -> int { asm print a; return 5; }
+function zero(int a) -> int { asm print a; return 0; }
+
+function main() -> int {
+    var int x = 2;
+    var int y = 1;
+    y = five(x);
+    print(y);
+    y = zero(x);
+    print(y);
+    five(x);
+    x = decrement(x);
+    print(x);
+    return 0;
+}
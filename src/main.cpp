@@ -1,11 +1,34 @@
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <sstream>
 #include <fstream>
 #include <algorithm>
+#include <memory>
+#include <cstdint>
+#include <limits>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <queue>
+#include <deque>
+#include <memory_resource>
+#include <optional>
+#include <chrono>
+#include <charconv>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 
@@ -55,45 +78,455 @@ class InvalidSyntax: public Exception {
 };
 
 
-class Token {
-    string::size_type line_number;
-    string::size_type character_number;
-    string::size_type byte_number;
-    string token_string;
+enum class TokenKind : unsigned char {
+    Identifier,
+    Integer,
+    Float,
+    String,
+    Boolean,
+
+    // keywords
+    Function,
+    Class,
+    Namespace,
+    Var,
+    Return,
+    Asm,
+    If,
+    While,
+    Break,
+
+    Newline,
+
+    // punctuation
+    LeftParen,
+    RightParen,
+    LeftBrace,
+    RightBrace,
+    Semicolon,
+    Comma,
+    Equals,
+    Minus,
+    Greater,
+    Dot,
+    Colon,
+    Slash,
+    Star,
+    ResolutionOperator,
+    Ellipsis,
+    Punctuation,    // any other punctuation character
+};
+
+constexpr TokenKind punctuationKind(char c) {
+    switch (c) {
+        case '(':
+            return TokenKind::LeftParen;
+        case ')':
+            return TokenKind::RightParen;
+        case '{':
+            return TokenKind::LeftBrace;
+        case '}':
+            return TokenKind::RightBrace;
+        case ';':
+            return TokenKind::Semicolon;
+        case ',':
+            return TokenKind::Comma;
+        case '=':
+            return TokenKind::Equals;
+        case '-':
+            return TokenKind::Minus;
+        case '>':
+            return TokenKind::Greater;
+        case '.':
+            return TokenKind::Dot;
+        case ':':
+            return TokenKind::Colon;
+        case '/':
+            return TokenKind::Slash;
+        case '*':
+            return TokenKind::Star;
+        default:
+            return TokenKind::Punctuation;
+    }
+}
+
+
+using Symbol = uint32_t;
+const Symbol no_symbol = numeric_limits<Symbol>::max();
+
+struct Keyword {
+    const char* spelling;
+    TokenKind kind;
+};
+// interned first and in this order, so that symbol of a keyword is its index in this table
+constexpr Keyword keywords[] = {
+    {"function", TokenKind::Function},
+    {"class", TokenKind::Class},
+    {"namespace", TokenKind::Namespace},
+    {"var", TokenKind::Var},
+    {"return", TokenKind::Return},
+    {"asm", TokenKind::Asm},
+    {"if", TokenKind::If},
+    {"while", TokenKind::While},
+    {"break", TokenKind::Break},
+    {"true", TokenKind::Boolean},
+    {"false", TokenKind::Boolean},
+};
+
+class Interner {
+    /*  Maps names to integer symbols.
+     *
+     *  Every distinct name is stored once and its symbol is the index of the stored copy, so
+     *  after lexing names are compared and hashed as integers.
+     *  Lookups take a pointer and a length so that interning a name already seen does not allocate.
+     */
+    vector<string> names;
+    // open addressing with linear probing, no_symbol marks an empty slot
+    vector<Symbol> slots;
+
+    static uint32_t hash(const char* s, string::size_type n) {
+        // FNV-1a
+        uint32_t h = 2166136261u;
+        for (string::size_type i = 0; i < n; ++i) {
+            h = ((h ^ static_cast<unsigned char>(s[i])) * 16777619u);
+        }
+        return h;
+    }
+    vector<Symbol>::size_type slot(const char* s, string::size_type n) const {
+        /*  Returns index of the slot holding the name, or of the empty slot the name would be stored in.
+         */
+        vector<Symbol>::size_type mask = (slots.size() - 1);
+        vector<Symbol>::size_type i = (hash(s, n) & mask);
+        while (slots[i] != no_symbol and not (names[slots[i]].size() == n and memcmp(names[slots[i]].data(), s, n) == 0)) {
+            i = ((i + 1) & mask);
+        }
+        return i;
+    }
+    void grow() {
+        slots.assign((slots.size() * 2), no_symbol);
+        for (Symbol each = 0; each < names.size(); ++each) {
+            slots[slot(names[each].data(), names[each].size())] = each;
+        }
+    }
 
     public:
-        decltype(line_number) line() const { return line_number; }
-        decltype(character_number) character() const { return character_number; }
-        decltype(byte_number) byte() const { return byte_number; }
-        string text() const { return token_string; }
-        void text(const string& s) { token_string = s; }
-        void textprepend(const string& s) { token_string = (s + token_string); }
+        Symbol find(const char* s, string::size_type n) const {
+            /*  Returns symbol of the name, or no_symbol if the name was never interned.
+             */
+            return slots[slot(s, n)];
+        }
+        Symbol find(const string& s) const {
+            return find(s.data(), s.size());
+        }
+        Symbol intern(const char* s, string::size_type n) {
+            auto i = slot(s, n);
+            if (slots[i] != no_symbol) {
+                return slots[i];
+            }
+            Symbol symbol = static_cast<Symbol>(names.size());
+            slots[i] = symbol;
+            names.emplace_back(s, n);
+            if ((names.size() * 2) > slots.size()) {
+                grow();
+            }
+            return symbol;
+        }
+        Symbol intern(const string& s) {
+            return intern(s.data(), s.size());
+        }
+        const string& name(Symbol symbol) const {
+            return names[symbol];
+        }
+        Symbol size() const {
+            return static_cast<Symbol>(names.size());
+        }
 
-        bool operator==(const string& s) const {
-            return (token_string == s);
+        vector<Symbol> merge(const Interner& other) {
+            /*  Interns all names of the other interner, in the order they were interned there.
+             *  Returns table translating symbols of the other interner to symbols of this one.
+             */
+            vector<Symbol> translation;
+            translation.reserve(other.names.size());
+            for (const auto& each : other.names) {
+                translation.push_back(intern(each));
+            }
+            return translation;
         }
-        bool operator!=(const string& s) const {
-            return (token_string != s);
+
+        static TokenKind kind(Symbol symbol) {
+            /*  Returns kind of a token that was interned to the symbol.
+             */
+            return (symbol < (sizeof(keywords) / sizeof(keywords[0])) ? keywords[symbol].kind : TokenKind::Identifier);
         }
 
-        operator std::string() const {
-            return token_string;
+        Interner(): slots(256, no_symbol) {
+            for (const auto& each : keywords) {
+                intern(each.spelling, strlen(each.spelling));
+            }
         }
+};
+
+class Token {
+    /*  Compact token.
+     *
+     *  Token does not own its text.
+     *  It is a span of the source buffer the TokenVector it belongs to was lexed from, or
+     *  (when a reduce pass rewrote the token with text that is not present verbatim in the source) an
+     *  index into the synthesized-text pool of that TokenVector.
+     *  Byte offset always points into the source buffer so diagnostics can locate the token;
+     *  line and column are not stored, they are resolved from the offset (see LineIndex).
+     *  Names (identifiers and keywords) also carry the symbol they were interned to.
+     */
+    uint32_t byte_number;
+    uint32_t text_length;   // length of the span, or pool index for synthesized tokens
+    Symbol symbol_id;
+    TokenKind token_kind;
+    bool synthesized;
+
+    friend class TokenVector;
 
-        Token(const string& s, string::size_type ln, string::size_type cn, string::size_type bn):
-            line_number(ln),
-            character_number(cn),
-            byte_number(bn),
-            token_string(s) {
+    public:
+        decltype(byte_number) byte() const { return byte_number; }
+        TokenKind kind() const { return token_kind; }
+        Symbol symbol() const { return symbol_id; }
+        bool isSynthesized() const { return synthesized; }
+
+        Token(string::size_type bn, string::size_type length, TokenKind k, Symbol sym = no_symbol):
+            byte_number(static_cast<uint32_t>(bn)),
+            text_length(static_cast<uint32_t>(length)),
+            symbol_id(sym),
+            token_kind(k),
+            synthesized(false) {
             }
         Token():
-            line_number(0),
-            character_number(0),
             byte_number(0),
-            token_string("") {
+            text_length(0),
+            symbol_id(no_symbol),
+            token_kind(TokenKind::Punctuation),
+            synthesized(false) {
+            }
+};
+
+class TokenVector {
+    /*  Vector of tokens referencing one source buffer.
+     *
+     *  Indexing returns lightweight references that materialize token text only on demand.
+     *  Symbols of the tokens refer to the interner shared by all vectors derived from this one.
+     */
+    const char* source;
+    string::size_type source_size;
+    Interner* interner;
+    vector<string> synthesized_text;
+    vector<Token> tokens;
+    // one past the highest index read through operator[]
+    mutable vector<Token>::size_type reached;
+
+    void synthesize(Token& t, string_view s) {
+        t.synthesized = true;
+        t.text_length = static_cast<uint32_t>(synthesized_text.size());
+        synthesized_text.emplace_back(s);
+    }
+
+    public:
+        using size_type = vector<Token>::size_type;
+
+        const char* data(const Token& t) const {
+            return (t.synthesized ? synthesized_text[t.text_length].data() : (source + t.byte_number));
+        }
+        string::size_type size(const Token& t) const {
+            return (t.synthesized ? synthesized_text[t.text_length].size() : t.text_length);
+        }
+        string text(const Token& t) const {
+            return string(data(t), size(t));
+        }
+        string_view view(const Token& t) const {
+            /*  Returns text of the token without copying it.
+             *  The view is invalidated when synthesized text of this vector changes.
+             */
+            return string_view(data(t), size(t));
+        }
+        bool equals(const Token& t, const char* s) const {
+            string::size_type n = size(t);
+            return (strlen(s) == n and memcmp(data(t), s, n) == 0);
+        }
+        bool equals(const Token& t, const string& s) const {
+            return (size(t) == s.size() and memcmp(data(t), s.data(), s.size()) == 0);
+        }
+
+        void text(Token& t, string_view s) {
+            /*  Replace text of the token.
+             *  If the new text is present verbatim in the source at the position of the token
+             *  the token keeps referencing the source, otherwise the text is synthesized.
+             */
+            if ((not t.synthesized) and (t.byte_number + s.size()) <= source_size and memcmp(source + t.byte_number, s.data(), s.size()) == 0) {
+                t.text_length = static_cast<uint32_t>(s.size());
+            } else {
+                synthesize(t, s);
+            }
+        }
+        void textprepend(Token& t, string_view s) {
+            /*  Prepend text to the token.
+             *  If the prepended text directly precedes the token in the source the token
+             *  is just extended to the left.
+             */
+            if ((not t.synthesized) and t.byte_number >= s.size() and memcmp(source + (t.byte_number - s.size()), s.data(), s.size()) == 0) {
+                t.byte_number -= static_cast<uint32_t>(s.size());
+                t.text_length += static_cast<uint32_t>(s.size());
+            } else {
+                synthesize(t, (string(s) + text(t)));
+            }
+        }
+        void kind(Token& t, TokenKind k) {
+            t.token_kind = k;
+        }
+        void intern(Token& t) {
+            /*  Interns current text of the token.
+             */
+            t.symbol_id = interner->intern(data(t), size(t));
+        }
+
+        Interner& symbols() const {
+            return *interner;
+        }
+
+        class ConstReference {
+            protected:
+                const TokenVector* vec;
+                size_type index;
+
+                const Token& token() const { return vec->tokens[index]; }
+
+                friend class TokenVector;
+
+            public:
+                const char* data() const { return vec->data(token()); }
+                string::size_type size() const { return vec->size(token()); }
+
+                string::size_type byte() const { return token().byte(); }
+                TokenKind kind() const { return token().kind(); }
+                Symbol symbol() const { return token().symbol(); }
+
+                string text() const { return vec->text(token()); }
+                string_view view() const { return vec->view(token()); }
+
+                bool operator==(const char* s) const {
+                    return vec->equals(token(), s);
+                }
+                bool operator!=(const char* s) const {
+                    return not operator==(s);
+                }
+                bool operator==(const string& s) const {
+                    return vec->equals(token(), s);
+                }
+                bool operator!=(const string& s) const {
+                    return not operator==(s);
+                }
+
+                operator std::string() const {
+                    return text();
+                }
+                operator string_view() const {
+                    return view();
+                }
+
+                ConstReference(const TokenVector* v, size_type i): vec(v), index(i) {}
+        };
+
+        class Reference: public ConstReference {
+            TokenVector* owner;
+
+            public:
+                using ConstReference::text;
+
+                void text(string_view s) {
+                    owner->text(owner->tokens[index], s);
+                }
+                void textprepend(string_view s) {
+                    owner->textprepend(owner->tokens[index], s);
+                }
+
+                Reference(TokenVector* v, size_type i): ConstReference(v, i), owner(v) {}
+        };
+
+        size_type size() const { return tokens.size(); }
+
+        ConstReference operator[](size_type i) const {
+            reached = max(reached, (i+1));
+            return ConstReference(this, i);
+        }
+        Reference operator[](size_type i) { return Reference(this, i); }
+        size_type reach() const { return reached; }
+        void resetReach() { reached = 0; }
+        Reference back() { return Reference(this, (tokens.size()-1)); }
+        const Token& at(size_type i) const { return tokens[i]; }
+
+        void push_back(const Token& t) {
+            tokens.push_back(t);
+        }
+        void push_back(const ConstReference& t) {
+            /*  Push token from another vector referencing the same source.
+             *  Synthesized text is copied to this vector's pool.
+             */
+            Token token = t.token();
+            if (token.synthesized and t.vec != this) {
+                synthesize(token, t.text());
+            }
+            tokens.push_back(token);
+        }
+        void pop_back() {
+            tokens.pop_back();
+        }
+        void reserve(size_type n) {
+            tokens.reserve(n);
+        }
+        void resize(size_type n) {
+            tokens.resize(n);
+        }
+        void splice(size_type at, const TokenVector& piece, const vector<Symbol>& translation) {
+            /*  Copies tokens of a piece lexed with a different interner to [at, at+piece.size()),
+             *  translating their symbols.
+             *  Pieces may be spliced into disjoint ranges concurrently.
+             */
+            for (size_type i = 0; i < piece.tokens.size(); ++i) {
+                Token token = piece.tokens[i];
+                if (token.symbol_id != no_symbol) {
+                    token.symbol_id = translation[token.symbol_id];
+                }
+                tokens[at + i] = token;
+            }
+        }
+        void clear() {
+            tokens.clear();
+            synthesized_text.clear();
+        }
+
+        void discard(size_type n) {
+            /*  Removes first n tokens.
+             */
+            tokens.erase(tokens.begin(), (tokens.begin() + static_cast<vector<Token>::difference_type>(n)));
+        }
+        void compact() {
+            /*  Drops synthesized text no longer referenced by any token in this vector.
+             *  Only safe when no copies of this vector's synthesized tokens are kept elsewhere.
+             */
+            vector<string> kept;
+            for (auto& each : tokens) {
+                if (each.synthesized) {
+                    kept.push_back(std::move(synthesized_text[each.text_length]));
+                    each.text_length = static_cast<uint32_t>(kept.size()-1);
+                }
             }
+            synthesized_text = std::move(kept);
+        }
+
+        TokenVector derive() const {
+            /*  Returns empty token vector referencing the same source.
+             */
+            return TokenVector(source, source_size, *interner);
+        }
+
+        TokenVector(const char* s, string::size_type n, Interner& symbols): source(s), source_size(n), interner(&symbols), reached(0) {}
 };
-using TokenVector = vector<Token>;
 using TokenVectorSize = TokenVector::size_type;
 
 
@@ -110,6 +543,131 @@ namespace support {
             // file otherwise
             return true;
         }
+
+        bool isstream(const string& path) {
+            /*  Returns true if path names a pipe, socket or character device
+             *  (e.g. /dev/stdin or a process substitution).
+             */
+            struct stat sf;
+
+            if (stat(path.c_str(), &sf) == -1) return false;
+
+            return (S_ISFIFO(sf.st_mode) or S_ISCHR(sf.st_mode) or S_ISSOCK(sf.st_mode));
+        }
+    }
+
+    namespace utf8 {
+        /*  Width of the blocks scanned at once.
+         *  Blocks are checked with vector instructions when they are available
+         *  (32 bytes with AVX2, 16 bytes with SSE2) and eight bytes at a time otherwise.
+         */
+#if defined(__AVX2__)
+        const string::size_type block = 32;
+#elif defined(__SSE2__)
+        const string::size_type block = 16;
+#else
+        const string::size_type block = 8;
+#endif
+
+        inline bool isasciiblock(const char* s) {
+            /*  Returns true if none of the block bytes starting at s has its high bit set.
+             */
+#if defined(__AVX2__)
+            return (_mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(s))) == 0);
+#elif defined(__SSE2__)
+            return (_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s))) == 0);
+#else
+            uint64_t word;
+            memcpy(&word, s, sizeof(word));
+            return ((word & 0x8080808080808080ull) == 0);
+#endif
+        }
+
+        string::size_type sequencelength(const unsigned char* s, string::size_type n) {
+            /*  Returns length of the well-formed UTF-8 sequence at the beginning of n bytes
+             *  starting at s, or 0 if the bytes do not begin with one.
+             *
+             *  Overlong encodings, surrogates and code points above U+10FFFF are rejected.
+             */
+            unsigned char c = s[0];
+            string::size_type length;
+            unsigned char low = 0x80, high = 0xbf;
+            if (c < 0x80) {
+                return 1;
+            } else if (c >= 0xc2 and c <= 0xdf) {
+                length = 2;
+            } else if (c >= 0xe0 and c <= 0xef) {
+                length = 3;
+                if (c == 0xe0) {
+                    low = 0xa0;
+                } else if (c == 0xed) {
+                    high = 0x9f;
+                }
+            } else if (c >= 0xf0 and c <= 0xf4) {
+                length = 4;
+                if (c == 0xf0) {
+                    low = 0x90;
+                } else if (c == 0xf4) {
+                    high = 0x8f;
+                }
+            } else {
+                return 0;
+            }
+
+            if (length > n or s[1] < low or s[1] > high) {
+                return 0;
+            }
+            for (string::size_type i = 2; i < length; ++i) {
+                if ((s[i] & 0xc0) != 0x80) {
+                    return 0;
+                }
+            }
+            return length;
+        }
+
+        string::size_type validate(const char* s, string::size_type n) {
+            /*  Returns offset of the first byte that is not part of a well-formed UTF-8 sequence,
+             *  or string::npos if all n bytes starting at s are valid UTF-8.
+             *
+             *  Pure ASCII blocks are skipped whole; only blocks containing other bytes
+             *  are decoded sequence by sequence.
+             */
+            const unsigned char* bytes = reinterpret_cast<const unsigned char*>(s);
+            string::size_type i = 0;
+            while (i < n) {
+                if ((n - i) >= block and isasciiblock(s + i)) {
+                    i += block;
+                    continue;
+                }
+                string::size_type length = sequencelength((bytes + i), (n - i));
+                if (length == 0) {
+                    return i;
+                }
+                i += length;
+            }
+            return string::npos;
+        }
+
+        string::size_type length(const char* s, string::size_type n) {
+            /*  Returns number of code points encoded in n bytes of valid UTF-8 starting at s.
+             *  Pure ASCII blocks are counted without looking at individual bytes.
+             */
+            string::size_type count = 0;
+            string::size_type i = 0;
+            while (i < n) {
+                if ((n - i) >= block and isasciiblock(s + i)) {
+                    count += block;
+                    i += block;
+                    continue;
+                }
+                // continuation bytes do not start a code point
+                if ((static_cast<unsigned char>(s[i]) & 0xc0) != 0x80) {
+                    ++count;
+                }
+                ++i;
+            }
+            return count;
+        }
     }
 
     namespace io {
@@ -133,141 +691,331 @@ namespace support {
             return lines;
         }
 
+        string readfd(int fd, const string& filename) {
+            /*  Reads everything from a file descriptor in bulk.
+             *  Used for inputs that cannot be mapped (pipes, standard input).
+             */
+            string text;
+            string::size_type length = 0;
+            text.resize(64 * 1024);
+
+            while (true) {
+                if (length == text.size()) {
+                    text.resize(text.size() * 2);
+                }
+                ssize_t n = read(fd, &text[length], (text.size() - length));
+                if (n == 0) {
+                    break;
+                }
+                if (n == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw ReadException(filename);
+                }
+                length += static_cast<string::size_type>(n);
+            }
+            text.resize(length);
+
+            return text;
+        }
+
         string readfile(const string& filename) {
             if (!support::env::isfile(filename)) {
                 throw NoSuchFile(filename);
             }
 
-            ifstream in(filename, ios::in | ios::binary);
-            if (!in) {
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd == -1) {
                 throw ReadException(filename);
             }
-
-            ostringstream text;
-            string line;
-            if (getline(in, line)) {
-                text << line;
-            }
-            while (getline(in, line)) {
-                text << '\n' << line;
+            string text;
+            try {
+                text = readfd(fd, filename);
+            } catch (const ReadException&) {
+                close(fd);
+                throw;
             }
+            close(fd);
 
-            return text.str();
+            return text;
         }
+
+        class MappedFile {
+            /*  Read-only view of the whole input.
+             *
+             *  Regular files are mapped into memory so the lexer reads the bytes directly from
+             *  the page cache.
+             *  Pipes and standard input (passed as "-") cannot be mapped and are read in bulk instead.
+             */
+            const char* bytes;
+            string::size_type length;
+            bool mapped;
+            string buffer;
+
+            public:
+                const char* data() const { return bytes; }
+                string::size_type size() const { return length; }
+
+                MappedFile(const string& filename): bytes(nullptr), length(0), mapped(false) {
+                    if (filename == "-") {
+                        buffer = readfd(STDIN_FILENO, filename);
+                        bytes = buffer.data();
+                        length = buffer.size();
+                        return;
+                    }
+
+                    if (not (support::env::isfile(filename) or support::env::isstream(filename))) {
+                        throw NoSuchFile(filename);
+                    }
+
+                    int fd = open(filename.c_str(), O_RDONLY);
+                    if (fd == -1) {
+                        throw ReadException(filename);
+                    }
+
+                    struct stat sf;
+                    if (fstat(fd, &sf) == -1) {
+                        close(fd);
+                        throw ReadException(filename);
+                    }
+
+                    if (S_ISREG(sf.st_mode) and sf.st_size > 0) {
+                        void* p = mmap(nullptr, static_cast<size_t>(sf.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                        if (p != MAP_FAILED) {
+                            madvise(p, static_cast<size_t>(sf.st_size), MADV_SEQUENTIAL);
+                            bytes = static_cast<const char*>(p);
+                            length = static_cast<string::size_type>(sf.st_size);
+                            mapped = true;
+                        }
+                    }
+                    if (not mapped) {
+                        try {
+                            buffer = readfd(fd, filename);
+                        } catch (const ReadException&) {
+                            close(fd);
+                            throw;
+                        }
+                        bytes = buffer.data();
+                        length = buffer.size();
+                    }
+                    close(fd);
+                }
+                MappedFile(const MappedFile&) = delete;
+                MappedFile& operator=(const MappedFile&) = delete;
+                ~MappedFile() {
+                    if (mapped) {
+                        munmap(const_cast<char*>(bytes), length);
+                    }
+                }
+        };
+
+        class LineIndex {
+            /*  Byte offsets at which lines of a buffer begin.
+             *
+             *  Built with one scan of the buffer, and only when a diagnostic needs it.
+             *  Line and column of a byte offset are then found with a binary search, and
+             *  any line can be sliced out of the buffer without scanning it again.
+             *  Lines and columns are counted from 0; columns count code points, so the
+             *  buffer must be valid UTF-8.
+             */
+            const char* bytes;
+            string::size_type length;
+            vector<string::size_type> starts;
+
+            public:
+                string::size_type lines() const {
+                    /*  Number of lines, not counting the empty one after a trailing newline.
+                     */
+                    return ((starts.back() == length) ? (starts.size() - 1) : starts.size());
+                }
+                string::size_type line(string::size_type byte) const {
+                    return static_cast<string::size_type>((upper_bound(starts.begin(), starts.end(), byte) - starts.begin()) - 1);
+                }
+                string::size_type column(string::size_type byte) const {
+                    string::size_type begin = starts[line(byte)];
+                    return support::utf8::length((bytes + begin), (byte - begin));
+                }
+                string text(string::size_type n) const {
+                    /*  Returns n-th line without its terminating newline.
+                     */
+                    string::size_type begin = starts[n];
+                    string::size_type end = ((n+1) < starts.size() ? (starts[n+1] - 1) : length);
+                    return string((bytes + begin), (end - begin));
+                }
+
+                LineIndex(const char* s, string::size_type n): bytes(s), length(n) {
+                    starts.push_back(0);
+                    const char* end = (s + n);
+                    for (const char* p = s; (p = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(end - p)))) != nullptr; ) {
+                        starts.push_back(static_cast<string::size_type>(++p - s));
+                    }
+                }
+        };
+    }
+
+    namespace parallel {
+        class ThreadPool {
+            /*  Fixed set of worker threads running submitted jobs.
+             */
+            vector<std::thread> workers;
+            std::queue<function<void()>> jobs;
+            mutex lock;
+            condition_variable wake;
+            condition_variable idle;
+            unsigned running;
+            bool stopping;
+
+            void work() {
+                while (true) {
+                    function<void()> job;
+                    {
+                        unique_lock<mutex> guard(lock);
+                        wake.wait(guard, [this]() { return (stopping or not jobs.empty()); });
+                        if (jobs.empty()) {
+                            return;
+                        }
+                        job = std::move(jobs.front());
+                        jobs.pop();
+                        ++running;
+                    }
+                    job();
+                    {
+                        unique_lock<mutex> guard(lock);
+                        --running;
+                        if (running == 0 and jobs.empty()) {
+                            idle.notify_all();
+                        }
+                    }
+                }
+            }
+
+            public:
+                void submit(function<void()> job) {
+                    {
+                        unique_lock<mutex> guard(lock);
+                        jobs.push(std::move(job));
+                    }
+                    wake.notify_one();
+                }
+                void wait() {
+                    /*  Blocks until all submitted jobs are finished.
+                     */
+                    unique_lock<mutex> guard(lock);
+                    idle.wait(guard, [this]() { return (running == 0 and jobs.empty()); });
+                }
+
+                ThreadPool(unsigned n): running(0), stopping(false) {
+                    for (unsigned i = 0; i < n; ++i) {
+                        workers.emplace_back([this]() { work(); });
+                    }
+                }
+                ThreadPool(const ThreadPool&) = delete;
+                ThreadPool& operator=(const ThreadPool&) = delete;
+                ~ThreadPool() {
+                    {
+                        unique_lock<mutex> guard(lock);
+                        stopping = true;
+                    }
+                    wake.notify_all();
+                    for (auto& each : workers) {
+                        each.join();
+                    }
+                }
+        };
     }
 
     namespace str {
-        bool startswith(const std::string& s, const std::string& w) {
+        /*  Predicates and slicing functions take and return non-owning views, so they
+         *  never allocate; returned views point into the argument and must not outlive it.
+         */
+        bool startswith(string_view s, string_view w) {
             /*  Returns true if s stars with w.
              */
             return (s.compare(0, w.length(), w) == 0);
         }
 
-        string sub(const string& s, long unsigned b = 0, long int e = -1) {
+        string_view sub(string_view s, long unsigned b = 0, long int e = -1) {
             /*  Returns substring of s.
-             *  If only s is passed, returns copy of s.
+             *  If only s is passed, returns whole s.
              */
-            if (b == 0 and e == -1) return string(s);
-
-            ostringstream part;
-            part.str("");
-
             long unsigned end;
-            if (e < 0) { end = (s.size() + e + 1); }
+            if (e < 0) { end = (s.size() + static_cast<long unsigned>(e) + 1); }
             else { end = static_cast<long unsigned>(e); }
+            end = min(end, s.size());
 
-            for (long unsigned i = b; i < s.size() and i < end; ++i) {
-                part << s[i];
+            if (b >= end) {
+                return string_view();
             }
+            return s.substr(b, (end - b));
+        }
 
-            return part.str();
+        inline bool iswhitespace(char c) {
+            return (c == ' ' or c == '\t' or c == '\v' or c == '\n');
         }
 
-        string lstrip(const string& s) {
+        string_view lstrip(string_view s) {
             /*  Removes whitespace from left side of the string.
              */
-            unsigned i = 0;
-            while (i < s.size()) {
-                if (not (s[i] == ' ' or s[i] == '\t' or s[i] == '\v' or s[i] == '\n')) {
-                    break;
-                };
+            string_view::size_type i = 0;
+            while (i < s.size() and iswhitespace(s[i])) {
                 ++i;
             }
-            return sub(s, i);
+            return s.substr(i);
         }
 
-        string chunk(const string& s, bool ignore_leading_ws = true) {
+        string_view chunk(string_view s, bool ignore_leading_ws = true) {
             /*  Returns part of the string until first whitespace from left side.
              */
-            ostringstream chnk;
+            string_view str = (ignore_leading_ws ? lstrip(s) : s);
 
-            string str = (ignore_leading_ws ? lstrip(s) : s);
-
-            for (unsigned i = 0; i < str.size(); ++i) {
-                if (str[i] == *" " or str[i] == *"\t" or str[i] == *"\v" or str[i] == *"\n") break;
-                chnk << str[i];
+            string_view::size_type i = 0;
+            while (i < str.size() and not iswhitespace(str[i])) {
+                ++i;
             }
-            return chnk.str();
+            return str.substr(0, i);
         }
 
-        bool startswithchunk(const std::string& s, const std::string& w) {
+        bool startswithchunk(string_view s, string_view w) {
             /*  Returns true if s stars with chunk w.
              */
             return (chunk(s) == w);
         }
 
-        bool endswith(const std::string& s, const std::string& w) {
+        bool endswith(string_view s, string_view w) {
             /*  Returns true if s ends with w.
              */
             return (s.compare(s.length()-w.length(), s.length(), w) == 0);
         }
 
-        bool isnum(const std::string& s, bool negatives = true) {
+        bool isnum(string_view s, bool negatives = true) {
             /*  Returns true if s contains only numerical characters.
              *  Regex equivalent: `^[0-9]+$`
              */
-            bool num = false;
-            unsigned start = 0;
-            if (s[0] == '-' and negatives) {
-                // must handle negative numbers
-                start = 1;
+            string_view::size_type start = ((negatives and not s.empty() and s[0] == '-') ? 1 : 0);
+            if (start == s.size()) {
+                return false;
             }
-            for (unsigned i = start; i < s.size(); ++i) {
-                switch (s[i]) {
-                    case '0':
-                    case '1':
-                    case '2':
-                    case '3':
-                    case '4':
-                    case '5':
-                    case '6':
-                    case '7':
-                    case '8':
-                    case '9':
-                        num = true;
-                        break;
-                    default:
-                        num = false;
+            for (string_view::size_type i = start; i < s.size(); ++i) {
+                if (s[i] < '0' or s[i] > '9') {
+                    return false;
                 }
-                if (!num) break;
             }
-            return num;
+            return true;
         }
 
-        bool isalpha(const std::string& s) {
+        bool isalpha(string_view s) {
             /** Returns true if s contains only letters.
              */
-            bool is_alpha = true;
-            for (std::string::size_type i = 0; i < s.size(); ++i) {
-                if (not ((s[i] >= 'A' and s[i] <= 'Z') or (s[i] >= 'a' and s[i] <= 'z'))) {
-                    is_alpha = false;
-                    break;
+            for (char c : s) {
+                if (not ((c >= 'A' and c <= 'Z') or (c >= 'a' and c <= 'z'))) {
+                    return false;
                 }
             }
-            return is_alpha;
+            return true;
         }
 
-        bool isname(const std::string& s) {
+        bool isname(string_view s) {
             /** Returns true if s is a valid name.
              */
             if (s.size() == 0) {
@@ -276,70 +1024,98 @@ namespace support {
             if (not isalpha(s.substr(0, 1))) {
                 return false;
             }
-            bool is_name = true;
-            for (std::string::size_type i = 1; i < s.size(); ++i) {
+            for (string_view::size_type i = 1; i < s.size(); ++i) {
                 if (not ((s[i] >= 'A' and s[i] <= 'Z') or (s[i] >= 'a' and s[i] <= 'z') or (s[i] >= '0' and s[i] <= '9') or s[i] == '_')) {
-                    is_name = false;
-                    break;
+                    return false;
                 }
             }
-            return is_name;
+            return true;
         }
 
-        bool isfloat(const std::string& s, bool negatives = true) {
+        bool isfloat(string_view s, bool negatives = true) {
             /*  Returns true if s contains only numerical characters.
              *  Regex equivalent: `^[0-9]+\.[0-9]+$`
+             *  Note that a string without a dot is checked as both parts, so integers are accepted too.
              */
-            bool is = false;
-            unsigned start = 0;
-            if (s[0] == '-' and negatives) {
-                // to handle negative numbers
-                start = 1;
-            }
-            int dot = -1;
-            for (unsigned i = start; i < s.size(); ++i) {
-                if (s[i] == '.') {
-                    dot = static_cast<int>(i);
-                    break;
-                }
+            string_view::size_type start = ((negatives and not s.empty() and s[0] == '-') ? 1 : 0);
+            string_view::size_type dot = s.find('.', start);
+            if (dot == string_view::npos) {
+                return isnum(s, negatives) and isnum(s);
             }
-            is = isnum(sub(s, 0, dot), negatives) and isnum(sub(s, (static_cast<unsigned>(dot)+1)));
-            return is;
+            return isnum(s.substr(0, dot), negatives) and isnum(s.substr(dot+1));
         }
 
-        bool isbooleanliteral(const string& s) {
+        bool isbooleanliteral(string_view s) {
             return (s == "true" or s == "false");
         }
 
-        vector<string> chunks(const string& s) {
+        vector<string_view> chunks(string_view s) {
             /*  Returns chunks of string.
              */
-            vector<string> chnks;
-            string tmp(lstrip(s));
-            string chnk;
+            vector<string_view> chnks;
+            string_view tmp = lstrip(s);
             while (tmp.size()) {
-                chnk = chunk(tmp);
-                tmp = lstrip(sub(tmp, chnk.size()));
+                string_view chnk = chunk(tmp);
+                tmp = lstrip(tmp.substr(chnk.size()));
                 chnks.push_back(chnk);
             }
             return chnks;
         }
 
-        string join(const string& s, const vector<string>& parts) {
+        template<typename T> string join(string_view s, const vector<T>& parts) {
             /** Join elements of vector with given string.
+             *  Size of the result is computed first so it is allocated only once.
              */
-            ostringstream oss;
-            long unsigned limit = parts.size();
-            for (long unsigned i = 0; i < limit; ++i) {
-                oss << parts[i];
-                if (i < (limit-1)) {
-                    oss << s;
+            string joined;
+            if (parts.empty()) {
+                return joined;
+            }
+            string::size_type size = (s.size() * (parts.size()-1));
+            for (const auto& each : parts) {
+                size += each.size();
+            }
+            joined.reserve(size);
+            for (typename vector<T>::size_type i = 0; i < parts.size(); ++i) {
+                if (i > 0) {
+                    joined.append(s.data(), s.size());
                 }
+                joined.append(parts[i].data(), parts[i].size());
             }
-            return oss.str();
+            return joined;
+        }
+
+        string::size_type extractlength(const char* s, string::size_type n) {
+            /** Returns length of the *enquoted chunk* at the beginning of n bytes starting at s.
+             *
+             *  The chunk is scanned in place; see extract() for the rules.
+             *  A quote is treated as escaped if any backslash was seen since the previous quote, so
+             *  it is sufficient to search for the next quote and then check whether the block
+             *  before it contains a backslash.
+             *  Every byte is visited at most twice, so scanning is linear in the length of the chunk.
+             *  Unterminated chunk extends to the end of input.
+             */
+            if (n == 0) {
+                return 0;
+            }
+
+            const char quote = s[0];
+            const char* end = (s + n);
+            const char* p = (s + 1);
+            while (p < end) {
+                const char* closing = static_cast<const char*>(memchr(p, quote, static_cast<size_t>(end - p)));
+                if (closing == nullptr) {
+                    break;
+                }
+                if (memchr(p, '\\', static_cast<size_t>(closing - p)) == nullptr) {
+                    return static_cast<string::size_type>(closing - s + 1);
+                }
+                p = (closing + 1);
+            }
+
+            return n;
         }
 
-        string extract(const string& s) {
+        string_view extract(string_view s) {
             /** Extracts *enquoted chunk*.
              *
              *  It is particularly useful if you have a string encoded in another string.
@@ -353,33 +1129,10 @@ namespace support {
              *  One character that is not recommended for use as a delimiter is the backslash as it is treated specially (as
              *  the escape character) by this function.
              */
-            if (s.size() == 0) {
-                return string("");
-            }
+            return s.substr(0, extractlength(s.data(), s.size()));
+        }
 
-            ostringstream chnk;
-            char quote;
-            chnk << (quote = s[0]);
-
-            int backs = 0;
-            for (unsigned i = 1; i < s.size(); ++i) {
-                chnk << s[i];
-                if (s[i] == quote and (backs == 0)) {
-                    break;
-                }
-                if (s[i] == quote and (backs != 0)) {
-                    backs = 0;
-                    continue;
-                }
-                if (s[i] == '\\') {
-                    ++backs;
-                }
-            }
-
-            return chnk.str();
-        }
-
-        unsigned lshare(const string& s, const string& w) {
+        unsigned lshare(string_view s, string_view w) {
             unsigned share = 0;
             for (unsigned i = 0; i < s.size() and i < w.size(); ++i) {
                 if (s[i] == w[i]) {
@@ -390,7 +1143,7 @@ namespace support {
             }
             return share;
         }
-        bool contains(const string&s, const char c) {
+        bool contains(string_view s, const char c) {
             bool it_does = false;
             for (unsigned i = 0; i < s.size(); ++i) {
                 if (s[i] == c) {
@@ -404,17 +1157,22 @@ namespace support {
         string enquote(const string& s) {
             /** Enquote the string.
              */
-            ostringstream encoded;
-            char closing = '"';
-
-            encoded << closing;
-            for (unsigned i = 0; i < s.size(); ++i) {
-                if (s[i] == closing) { encoded << "\\"; }
-                encoded << s[i];
+            const char closing = '"';
+            string encoded;
+            encoded.reserve(s.size() + 2);
+
+            encoded += closing;
+            string::size_type begin = 0, i;
+            while ((i = s.find(closing, begin)) != string::npos) {
+                encoded.append(s, begin, (i - begin));
+                encoded += '\\';
+                encoded += closing;
+                begin = (i + 1);
             }
-            encoded << closing;
+            encoded.append(s, begin, string::npos);
+            encoded += closing;
 
-            return encoded.str();
+            return encoded;
         }
 
         string strdecode(const string& s) {
@@ -433,94 +1191,95 @@ namespace support {
              *  leaves only the character preceded by it in the outpur string.
              *
              */
-            ostringstream decoded;
-            char c;
-            for (unsigned i = 0; i < s.size(); ++i) {
-                c = s[i];
-                if (c == '\\' and i < (s.size()-1)) {
-                    ++i;
-                    switch (s[i]) {
-                        case '\'':
-                            c = '\'';
-                            break;
-                        case '"':
-                            c = '"';
-                            break;
-                        case '?':
-                            c = '?';
-                            break;
-                        case '\\':
-                            c = '\\';
-                            break;
-                        case 'a':
-                            c = '\a';
-                            break;
-                        case 'b':
-                            c = '\b';
-                            break;
-                        case 'f':
-                            c = '\f';
-                            break;
-                        case 'n':
-                            c = '\n';
-                            break;
-                        case 'r':
-                            c = '\r';
-                            break;
-                        case 't':
-                            c = '\t';
-                            break;
-                        case 'v':
-                            c = '\v';
-                            break;
-                        default:
-                            c = s[i];
-                    }
+            string decoded;
+            decoded.reserve(s.size());
+
+            // runs of characters between backslashes are copied in bulk
+            string::size_type begin = 0, i;
+            while ((i = s.find('\\', begin)) != string::npos and i < (s.size()-1)) {
+                decoded.append(s, begin, (i - begin));
+                char c = s[++i];
+                switch (c) {
+                    case 'a':
+                        c = '\a';
+                        break;
+                    case 'b':
+                        c = '\b';
+                        break;
+                    case 'f':
+                        c = '\f';
+                        break;
+                    case 'n':
+                        c = '\n';
+                        break;
+                    case 'r':
+                        c = '\r';
+                        break;
+                    case 't':
+                        c = '\t';
+                        break;
+                    case 'v':
+                        c = '\v';
+                        break;
+                    default:
+                        // \', \", \?, \\ and any other character stand for themselves
+                        break;
                 }
-                decoded << c;
+                decoded += c;
+                begin = (i + 1);
             }
-            return decoded.str();
+            decoded.append(s, begin, string::npos);
+
+            return decoded;
         }
         string strencode(const string& s) {
             /** Encode escape sequences in strings.
              *
              *  Reverse of strdecode() function.
              */
-            ostringstream encoded;
-            char c;
-            for (unsigned i = 0; i < s.size(); ++i) {
-                c = s[i];
+            string encoded;
+            encoded.reserve(s.size());
+
+            // runs of characters that need no escaping are copied in bulk
+            string::size_type begin = 0;
+            for (string::size_type i = 0; i < s.size(); ++i) {
+                char escape;
                 switch (s[i]) {
                     case '\\':
-                        encoded << "\\\\";
+                        escape = '\\';
                         break;
                     case '\a':
-                        encoded << "\\a";
+                        escape = 'a';
                         break;
                     case '\b':
-                        encoded << "\\b";
+                        escape = 'b';
                         break;
                     case '\f':
-                        encoded << "\\f";
+                        escape = 'f';
                         break;
                     case '\n':
-                        encoded << "\\n";
+                        escape = 'n';
                         break;
                     case '\r':
-                        encoded << "\\r";
+                        escape = 'r';
                         break;
                     case '\t':
-                        encoded << "\\t";
+                        escape = 't';
                         break;
                     case '\v':
-                        encoded << "\\v";
+                        escape = 'v';
                         break;
                     default:
-                        encoded << c;
-                        break;
+                        continue;
                 }
+                encoded.append(s, begin, (i - begin));
+                encoded += '\\';
+                encoded += escape;
+                begin = (i + 1);
             }
-            return encoded.str();
+            encoded.append(s, begin, string::npos);
+
+            return encoded;
         }
 
         string stringify(const vector<string>& sv) {
@@ -602,7 +1361,7 @@ namespace support {
                             tokens.push_back(token.str());
                             token.str("");
                         }
-                        tk = support::str::extract(s.substr(i));
+                        tk = s.substr(i, support::str::extractlength((s.data() + i), (s.size() - i)));
                         // -1 to not consume the next token as it
                         // may be meaningful (e.g. a semicolon)
                         i += (tk.size()-1);
@@ -622,136 +1381,342 @@ namespace support {
             return tokens;
         }
 
-        Token getToken(ostringstream& t, string::size_type line_no, string::size_type char_no, string::size_type byte_no) {
-            string tok = t.str();
-            return Token(tok, line_no, (char_no - tok.size()), (byte_no - tok.size()));
-        }
-        Token getToken(const string& tok, string::size_type line_no, string::size_type char_no, string::size_type byte_no) {
-            return Token(tok, line_no, (char_no - tok.size()), (byte_no - tok.size()));
-        }
+        enum class CharClass : unsigned char {
+            Word,
+            Blank,
+            Delimiter,
+            Newline,
+            Quote,
+        };
 
-        TokenVector lex(const string& s) {
-            TokenVector tokens;
-            ostringstream token;
-            string::size_type i = 0;
+        struct CharClassTable {
+            /*  Lexical class of every byte, computed at compile time.
+             */
+            CharClass classes[256];
 
-            string::size_type line_no = 0;
-            string::size_type byte_no = 0;
-            string::size_type char_no = 0;
+            constexpr CharClass operator[](char c) const {
+                return classes[static_cast<unsigned char>(c)];
+            }
 
-            char c; // for by-character extraction
-            string tk; // for string extraction
-            while (i < s.size()) {
-                c = s[i];
-                switch (c) {
-                    case ' ':
-                    case '\t':
-                        if (token.str().size() != 0) {
-                            tokens.push_back(getToken(token, line_no, char_no, byte_no));
-                            token.str("");
-                        }
-                        break;
-                    case '\n':
-                    case '(':
-                    case ')':
-                    case '[':
-                    case ']':
-                    case '{':
-                    case '}':
-                    case '<':
-                    case '>':
-                    case '~':
-                    case '!':
-                    case '@':
-                    case '#':
-                    case '$':
-                    case '%':
-                    case '^':
-                    case '&':
-                    case '*':
-                    case '-':
-                    case '+':
-                    case '=':
-                    case '|':
-                    case '\\':
-                    case ':':
-                    case ';':
-                    case ',':
-                    case '.':
-                    case '?':
-                    case '/':
-                        if (token.str().size() != 0) {
-                            tokens.push_back(getToken(token, line_no, char_no, byte_no));
-                            token.str("");
-                        }
-                        token << c;
-                        tokens.push_back(getToken(token, line_no, char_no, byte_no));
-                        token.str("");
-                        if (c == '\n') {
-                            ++line_no;
-                            char_no = 0;
-                        }
-                        break;
-                    case '"':
-                    case '\'':
-                        if (token.str().size() != 0) {
-                            tokens.push_back(getToken(token, line_no, char_no, byte_no));
-                            token.str("");
+            constexpr CharClassTable(): classes{} {
+                for (auto& each : classes) {
+                    each = CharClass::Word;
+                }
+                classes[static_cast<unsigned char>(' ')] = CharClass::Blank;
+                classes[static_cast<unsigned char>('\t')] = CharClass::Blank;
+                classes[static_cast<unsigned char>('\n')] = CharClass::Newline;
+                for (char c : "()[]{}<>~!@#$%^&*-+=|\\:;,.?/") {
+                    if (c != '\0') {
+                        classes[static_cast<unsigned char>(c)] = CharClass::Delimiter;
+                    }
+                }
+                classes[static_cast<unsigned char>('"')] = CharClass::Quote;
+                classes[static_cast<unsigned char>('\'')] = CharClass::Quote;
+            }
+        };
+        constexpr CharClassTable char_classes;
+
+        class Lexer {
+            /*  Pull-based lexer.
+             *
+             *  Produces primitive tokens one at a time so that the source can be compiled
+             *  without ever holding all of its tokens in memory.
+             *  Tokens reference the lexed buffer so it must outlive them.
+             */
+            const char* s;
+            string::size_type n;
+            string::size_type i;
+            string::size_type stop;
+            Interner& symbols;
+
+            Token word(string::size_type begin, string::size_type end) const {
+                /*  Numbers are literals, every other word is a name and is interned.
+                 */
+                if (all_of((s + begin), (s + end), [](char c) { return (c >= '0' and c <= '9'); })) {
+                    return Token(begin, (end - begin), TokenKind::Integer);
+                }
+                Symbol symbol = symbols.intern((s + begin), (end - begin));
+                return Token(begin, (end - begin), Interner::kind(symbol), symbol);
+            }
+
+            public:
+                bool next(Token& token) {
+                    /*  Stores next token in the argument.
+                     *  Returns false when input is exhausted.
+                     */
+                    while (i < n and i < stop) {
+                        string::size_type begin = i;
+                        switch (char_classes[s[i]]) {
+                            case CharClass::Word:
+                                while (++i < n and char_classes[s[i]] == CharClass::Word);
+                                token = word(begin, i);
+                                return true;
+                            case CharClass::Blank:
+                                ++i;
+                                break;
+                            case CharClass::Newline:
+                                token = Token(i++, 1, TokenKind::Newline);
+                                return true;
+                            case CharClass::Delimiter:
+                                token = Token(i, 1, punctuationKind(s[i]));
+                                ++i;
+                                return true;
+                            case CharClass::Quote:
+                                // string literals are scanned in place, never copied
+                                i += extractlength((s + i), (n - i));
+                                token = Token(begin, (i - begin), TokenKind::String);
+                                return true;
                         }
-                        tk = support::str::extract(s.substr(i));
-                        // -1 to not consume the next token as it
-                        // may be meaningful (e.g. a semicolon)
-                        i += (tk.size()-1);
-                        tokens.push_back(getToken(tk, line_no, char_no, byte_no));
-                        break;
-                    default:
-                        token << c;
-                        break;
+                    }
+                    return false;
                 }
-                ++byte_no;
-                ++char_no;
-                ++i;
+
+                string::size_type position() const {
+                    /*  Offset at which the lexer continues.
+                     *  The lexer has no other state, so lexing from two equal positions
+                     *  gives equal tokens.
+                     */
+                    return i;
+                }
+
+                Lexer(const char* source, string::size_type size, Interner& interner):
+                    s(source), n(size), i(0), stop(size), symbols(interner) {}
+                Lexer(const char* source, string::size_type size, Interner& interner, string::size_type begin, string::size_type end):
+                    /*  Lexes only tokens beginning in [begin, end) of the buffer.
+                     *  Tokens that begin before end may extend past it.
+                     */
+                    s(source), n(size), i(begin), stop(end), symbols(interner) {}
+        };
+
+        TokenVector lex(const char* s, string::size_type n, Interner& symbols) {
+            /*  Lexes n bytes starting at s.
+             *  Returned tokens reference the buffer so it must outlive them.
+             */
+            TokenVector tokens(s, n, symbols);
+            // rough estimate, avoids most of the reallocations on big inputs
+            tokens.reserve(n / 4);
+
+            Lexer lexer(s, n, symbols);
+            Token token;
+            while (lexer.next(token)) {
+                tokens.push_back(token);
             }
 
-            if (token.str().size()) {
-                tokens.push_back(getToken(token, line_no, char_no, byte_no));
+            return tokens;
+        }
+
+        // sources smaller than this are lexed serially even if more jobs are allowed
+        const string::size_type parallel_lexing_threshold = (1024 * 1024);
+
+        TokenVector lex(const char* s, string::size_type n, Interner& symbols, unsigned jobs) {
+            /*  Lexes n bytes starting at s using up to jobs threads.
+             *
+             *  The source is cut into pieces just after newlines followed by the "function" keyword
+             *  and the pieces are lexed concurrently, each with its own interner.
+             *  A cut is only correct if the serial lexer would be at that very offset (not inside
+             *  a string that spans it); this is checked after the pieces are lexed by comparing
+             *  the offset at which the previous piece stopped, and a piece that started at a wrong
+             *  offset is lexed again from the right one.
+             *  Symbols of each piece are then translated to the shared interner in the order of
+             *  their first appearance, so the result is exactly what the serial lexer produces.
+             */
+            if (jobs < 2 or n < parallel_lexing_threshold) {
+                return lex(s, n, symbols);
+            }
+
+            vector<string::size_type> cuts { 0 };
+            const char needle[] = "\nfunction";
+            for (unsigned k = 1; k < jobs; ++k) {
+                string::size_type target = max((n / jobs * k), cuts.back());
+                const char* found = static_cast<const char*>(memmem((s + target), (n - target), needle, (sizeof(needle) - 1)));
+                if (found == nullptr) {
+                    break;
+                }
+                string::size_type cut = static_cast<string::size_type>(found - s + 1);
+                if (cut > cuts.back()) {
+                    cuts.push_back(cut);
+                }
+            }
+            cuts.push_back(n);
+
+            struct Piece {
+                Interner symbols;
+                TokenVector tokens;
+                string::size_type end;
+
+                void lex(const char* s, string::size_type n, string::size_type from, string::size_type to) {
+                    tokens.clear();
+                    tokens.reserve((to - min(from, to)) / 4);
+                    Lexer lexer(s, n, symbols, from, to);
+                    Token token;
+                    while (lexer.next(token)) {
+                        tokens.push_back(token);
+                    }
+                    end = lexer.position();
+                }
+
+                Piece(const char* s, string::size_type n): tokens(s, n, symbols), end(0) {}
+            };
+            vector<unique_ptr<Piece>> pieces;
+            for (decltype(cuts)::size_type k = 0; (k+1) < cuts.size(); ++k) {
+                pieces.emplace_back(new Piece(s, n));
             }
 
+            support::parallel::ThreadPool pool(jobs);
+            for (decltype(pieces)::size_type k = 0; k < pieces.size(); ++k) {
+                pool.submit([&, k]() { pieces[k]->lex(s, n, cuts[k], cuts[k+1]); });
+            }
+            pool.wait();
+
+            for (decltype(pieces)::size_type k = 1; k < pieces.size(); ++k) {
+                if (pieces[k-1]->end != cuts[k]) {
+                    // previous piece ran past the cut, continue from where it stopped
+                    pieces[k]->symbols = Interner();
+                    pieces[k]->lex(s, n, pieces[k-1]->end, cuts[k+1]);
+                }
+            }
+
+            vector<vector<Symbol>> translations(pieces.size());
+            TokenVectorSize total = 0;
+            for (decltype(pieces)::size_type k = 0; k < pieces.size(); ++k) {
+                translations[k] = symbols.merge(pieces[k]->symbols);
+                total += pieces[k]->tokens.size();
+            }
+
+            TokenVector tokens(s, n, symbols);
+            tokens.resize(total);
+            TokenVectorSize at = 0;
+            for (decltype(pieces)::size_type k = 0; k < pieces.size(); ++k) {
+                pool.submit([&, k, at]() { tokens.splice(at, pieces[k]->tokens, translations[k]); });
+                at += pieces[k]->tokens.size();
+            }
+            pool.wait();
+
             return tokens;
         }
     }
 }
 
+using TypeID = uint32_t;
+const TypeID no_type = numeric_limits<TypeID>::max();
+
+class TypeTable {
+    /*  Hash-consed table of types.
+     *
+     *  Every distinct type is stored once and identified by its index, so types are compared
+     *  by comparing integers.
+     *  Named types are keyed by their spelling, function types by their parameter and return types;
+     *  a function type is thus built from IDs and never from strings.
+     *  Spellings are produced only when a type has to be shown to the user.
+     */
+    struct Type {
+        string name;
+        vector<TypeID> parameters;
+        TypeID returns;
+    };
+    struct Hash {
+        size_t operator()(const vector<TypeID>& key) const {
+            size_t h = 2166136261u;
+            for (auto each : key) {
+                h = ((h ^ each) * 16777619u);
+            }
+            return h;
+        }
+    };
+
+    vector<Type> types;
+    unordered_map<string, TypeID> named_types;
+    // key of a function type is its parameter types followed by its return type
+    unordered_map<vector<TypeID>, TypeID, Hash> function_types;
+
+    public:
+        static const TypeID int_type = 0;
+        static const TypeID float_type = 1;
+        static const TypeID string_type = 2;
+        static const TypeID bool_type = 3;
+        static const TypeID auto_type = 4;
+        static const TypeID void_type = 5;
+
+        TypeID find(const string& spelling) const {
+            /*  Returns ID of named type, or no_type if no type has such spelling.
+             */
+            auto found = named_types.find(spelling);
+            return (found == named_types.end() ? no_type : found->second);
+        }
+        TypeID named(const string& spelling) {
+            auto found = named_types.find(spelling);
+            if (found != named_types.end()) {
+                return found->second;
+            }
+            types.push_back(Type { spelling, {}, no_type });
+            return (named_types[spelling] = static_cast<TypeID>(types.size() - 1));
+        }
+        TypeID function(vector<TypeID> parameters, TypeID returns) {
+            parameters.push_back(returns);
+            auto found = function_types.find(parameters);
+            if (found != function_types.end()) {
+                return found->second;
+            }
+            TypeID id = static_cast<TypeID>(types.size());
+            function_types.emplace(parameters, id);
+            parameters.pop_back();
+            types.push_back(Type { "", move(parameters), returns });
+            return id;
+        }
+
+        bool isFunction(TypeID t) const {
+            return (t != no_type and types[t].returns != no_type);
+        }
+
+        string signature(TypeID t) const {
+            /*  Spelling of function type without the "function" prefix, e.g. "(int,auto)->int".
+             */
+            ostringstream oss;
+            oss << '(';
+            for (vector<TypeID>::size_type i = 0; i < types[t].parameters.size(); ++i) {
+                oss << name(types[t].parameters[i]);
+                if ((i+1) < types[t].parameters.size()) {
+                    oss << ",";
+                }
+            }
+            oss << ")->" << name(types[t].returns);
+            return oss.str();
+        }
+        string name(TypeID t) const {
+            if (t == no_type) {
+                return "";
+            }
+            return (isFunction(t) ? ("function" + signature(t)) : types[t].name);
+        }
+
+        TypeTable() {
+            for (auto spelling : { "int", "float", "string", "bool", "auto", "void" }) {
+                named(spelling);
+            }
+        }
+};
+
 struct FunctionEnvironment;
 
 struct FunctionSignature {
     string function_name;
-    string return_type;
+    TypeID return_type;
     vector<string> parameters;
-    map<string, string> parameter_types;
+    map<string, TypeID> parameter_types;
+    // type of the function itself
+    TypeID function_type;
+
+    const TypeTable* types;
 
     string type() const {
-        ostringstream oss;
-        oss << '(';
-        auto limit = (parameters.size()-1);
-        for (vector<string>::size_type i = 0; i < parameters.size(); ++i) {
-            oss << parameter_types.at(parameters[i]);
-            if (i < limit) {
-                oss << ",";
-            }
-        }
-        oss << ")->" << return_type;
-        return oss.str();
-    }
-    string typeof() const {
-        return ("function" + type());
+        return types->signature(function_type);
     }
     string header(bool full = false) const {
         ostringstream oss;
         oss << function_name << '(';
         auto limit = (parameters.size()-1);
         for (vector<string>::size_type i = 0; i < parameters.size(); ++i) {
-            oss << parameter_types.at(parameters[i]);
+            oss << types->name(parameter_types.at(parameters[i]));
             if (full) {
                 oss << ' ' << parameters[i];
             }
@@ -759,15 +1724,17 @@ struct FunctionSignature {
                 oss << ", ";
             }
         }
-        oss << ")->" << return_type;
+        oss << ")->" << types->name(return_type);
         return oss.str();
     }
 
-    FunctionSignature(const string& n, const string& r):
+    FunctionSignature(const string& n, TypeID r, const TypeTable& t):
         function_name(n),
-        return_type(r)
+        return_type(r),
+        function_type(no_type),
+        types(&t)
     {}
-    FunctionSignature(): function_name(""), return_type("") {}
+    FunctionSignature(): function_name(""), return_type(no_type), function_type(no_type), types(nullptr) {}
 };
 
 struct Class {
@@ -777,143 +1744,641 @@ struct Class {
     Class(const string& n): name(n) {}
 };
 
-struct CompilationEnvironment {
-    map<string, string> functions;
-    map<string, FunctionSignature> signatures;
-    map<string, Class> classes;
+class SignatureTable {
+    /*  Signatures of all declared functions, hashed by name.
+     *
+     *  Signatures are never moved once declared, so references returned by lookups stay valid
+     *  for the whole compilation (declaring a function again updates its signature in place).
+     *  Functions declared with a name qualified by the global namespace (e.g. "::f") can also be
+     *  found by their unqualified name; the alias is recorded once, at declaration.
+     */
+    deque<FunctionSignature> signatures;
+    unordered_map<string, deque<FunctionSignature>::size_type> by_name;
+    unordered_map<string, deque<FunctionSignature>::size_type> by_unqualified_name;
+
+    public:
+        const FunctionSignature& declare(const FunctionSignature& signature) {
+            auto found = by_name.find(signature.function_name);
+            if (found != by_name.end()) {
+                return (signatures[found->second] = signature);
+            }
+            auto id = signatures.size();
+            signatures.push_back(signature);
+            by_name.emplace(signature.function_name, id);
+            if (support::str::startswith(signature.function_name, "::")) {
+                by_unqualified_name.emplace(signature.function_name.substr(2), id);
+            }
+            return signatures.back();
+        }
+
+        const FunctionSignature* find(const string& name) const {
+            /*  Returns signature of function with exactly this name, or nullptr.
+             */
+            auto found = by_name.find(name);
+            return (found == by_name.end() ? nullptr : &signatures[found->second]);
+        }
+        const FunctionSignature* resolve(const string& name) const {
+            /*  Returns signature of function the name refers to, or nullptr.
+             *  Exact names take precedence over unqualified names of functions in the global namespace.
+             */
+            const FunctionSignature* signature = find(name);
+            if (signature == nullptr) {
+                auto found = by_unqualified_name.find(name);
+                signature = (found == by_unqualified_name.end() ? nullptr : &signatures[found->second]);
+            }
+            return signature;
+        }
+        const FunctionSignature& at(const string& name) const {
+            return signatures[by_name.at(name)];
+        }
 };
 
-struct Scope {
-    map<string, unsigned> variable_registers;
-    map<string, string> variable_types;
-    map<string, string> variable_values;
+class PassManager;
+struct InlineFunction;
 
-    unsigned ifs;
+struct CompilationEnvironment {
+    SignatureTable signatures;
+    map<string, Class> classes;
 
-    unsigned whiles;
-    string loop_begin;
-    string loop_end;
+    Interner* symbols;
+    TypeTable types;
+
+    // where to report register counts of compiled functions, if anywhere
+    ostream* register_report;
+    // passes run over the code of each compiled function
+    PassManager* passes;
+    // where to report instructions removed by the peephole optimiser, if anywhere
+    ostream* peephole_report;
+    // compiled functions that can be inlined at their call sites, by name
+    map<string, shared_ptr<const InlineFunction>, less<>> inline_functions;
+
+    CompilationEnvironment(Interner& s, ostream* report, PassManager* p, ostream* peephole = nullptr):
+        symbols(&s),
+        register_report(report),
+        passes(p),
+        peephole_report(peephole)
+    {}
+};
 
-    Scope* parent;
-    FunctionEnvironment* function;
+struct Variable {
+    unsigned register_index;
+    TypeID type;
+    // kept in the memory of the function the variable belongs to
+    string_view value;
+};
 
-    unsigned size() const {
-        unsigned sz = variable_registers.size();
-        if (parent) {
-            sz += parent->size();
+class SymbolTable {
+    /*  Variables of one function, in all of its nested scopes.
+     *
+     *  Every definition is appended to a stack of bindings; entering a scope records the height
+     *  of the stack and leaving it pops the bindings made since, so the table always holds exactly
+     *  the variables visible in the innermost scope being compiled.
+     *  An open-addressing hash table maps each name to its innermost binding, and each binding
+     *  remembers the binding it shadows, so lookups take constant time no matter how deeply
+     *  blocks are nested.
+     *  All memory of the table (including values of variables) comes from the memory resource
+     *  of the function and is released with it.
+     */
+    using size_type = vector<Variable>::size_type;
+    static const size_type none = numeric_limits<size_type>::max();
+
+    struct Binding {
+        Symbol name;
+        Variable variable;
+        size_type shadowed;
+    };
+    struct Slot {
+        Symbol name;
+        size_type binding;
+    };
+
+    pmr::memory_resource* memory;
+    pmr::vector<Binding> bindings;
+    pmr::vector<size_type> markers;
+    // linear probing; slots are never removed, a name without live bindings keeps its slot
+    pmr::vector<Slot> slots;
+    size_type used;
+
+    size_type slot(Symbol name) const {
+        size_type mask = (slots.size() - 1);
+        size_type i = ((static_cast<size_type>(name) * 2654435761u) & mask);
+        while (slots[i].name != no_symbol and slots[i].name != name) {
+            i = ((i + 1) & mask);
         }
-        return sz;
+        return i;
     }
-
-    vector<string> names() const {
-        vector<string> ns;
-        if (parent) {
-            ns = parent->names();
+    void grow() {
+        pmr::vector<Slot> old((slots.size() * 2), Slot { no_symbol, none }, memory);
+        old.swap(slots);
+        for (const auto& each : old) {
+            if (each.name != no_symbol) {
+                slots[slot(each.name)] = each;
+            }
         }
+    }
 
-        auto p = variable_registers.begin();
-        while (p != variable_registers.end()) {
-            ns.push_back(p->first);
-            ++p;
+    public:
+        const Variable* find(Symbol name) const {
+            /*  Returns innermost visible variable with given name, or nullptr.
+             */
+            if (name == no_symbol) {
+                return nullptr;
+            }
+            size_type binding = slots[slot(name)].binding;
+            return (binding == none ? nullptr : &bindings[binding].variable);
+        }
+        void define(Symbol name, Variable variable) {
+            /*  Defines variable in the innermost scope.
+             *  Defining a name again in the same scope replaces the variable, in an inner scope shadows it.
+             */
+            if (not variable.value.empty()) {
+                char* value = static_cast<char*>(memory->allocate(variable.value.size(), 1));
+                variable.value = string_view(value, variable.value.copy(value, variable.value.size()));
+            }
+            size_type i = slot(name);
+            if (slots[i].name == no_symbol) {
+                slots[i] = Slot { name, none };
+                if ((++used * 2) > slots.size()) {
+                    grow();
+                    i = slot(name);
+                }
+            }
+            size_type innermost = slots[i].binding;
+            if (innermost != none and innermost >= markers.back()) {
+                bindings[innermost].variable = variable;
+                return;
+            }
+            bindings.push_back(Binding { name, variable, innermost });
+            slots[i].binding = (bindings.size() - 1);
         }
 
-        return ns;
-    }
-
-    bool defined(const string& name) {
-        if (variable_registers.count(name)) {
-            return true;
-        } else if (parent == nullptr) {
-            return false;
-        } else {
-            return parent->defined(name);
+        void enter() {
+            markers.push_back(bindings.size());
+        }
+        void leave() {
+            while (bindings.size() > markers.back()) {
+                slots[slot(bindings.back().name)].binding = bindings.back().shadowed;
+                bindings.pop_back();
+            }
+            markers.pop_back();
         }
-    }
 
-    unsigned registerof(const string& name, TokenVectorSize offset) {
-        if (variable_registers.count(name)) {
-            return variable_registers.at(name);
-        } else if (parent == nullptr) {
-            throw InvalidSyntax(offset, ("access to name not present in scope: " + name));
-        } else {
-            return parent->registerof(name, offset);
+        size_type size() const {
+            /*  Number of visible variables, shadowed ones included.
+             */
+            return bindings.size();
+        }
+        vector<string> names(const Interner& symbols) const {
+            /*  Names of visible variables, outermost scope first and in alphabetical order within each scope.
+             */
+            vector<string> ns;
+            for (size_type m = 0; m < markers.size(); ++m) {
+                auto begin = ns.size();
+                size_type end = ((m+1) < markers.size() ? markers[m+1] : bindings.size());
+                for (size_type b = markers[m]; b < end; ++b) {
+                    ns.push_back(symbols.name(bindings[b].name));
+                }
+                sort((ns.begin() + static_cast<vector<string>::difference_type>(begin)), ns.end());
+            }
+            return ns;
         }
-    }
 
-    unsigned setregisterof(const string& name, unsigned n) {
-        variable_registers[name] = n;
-        return n;
+        SymbolTable(pmr::memory_resource* m):
+            memory(m),
+            bindings(m),
+            markers(m),
+            slots(16, Slot { no_symbol, none }, m),
+            used(0)
+        {}
+};
+
+struct Scope {
+    /*  Handle of a lexical scope inside a function.
+     *
+     *  Variables are kept in the symbol table of the function; a scope only marks where its
+     *  definitions begin, and drops them when it is destroyed.
+     *  Lookups by name are provided for names that do not come straight from a token
+     *  (e.g. temporaries introduced by the compiler).
+     */
+    Scope* parent;
+    FunctionEnvironment* function;
+
+    Interner& symbols() const;
+    TypeTable& types() const;
+    SymbolTable& variables() const;
+
+    unsigned size() const {
+        return static_cast<unsigned>(variables().size());
     }
 
-    string typeof(const string& name, TokenVectorSize offset) {
-        if (variable_types.count(name)) {
-            return variable_types.at(name);
-        } else if (parent == nullptr) {
-            throw InvalidSyntax(offset, ("access to name not present in scope: " + name));
-        } else {
-            return parent->typeof(name, offset);
-        }
+    vector<string> names() const {
+        return variables().names(symbols());
     }
 
-    string settypeof(const string& name, const string& type) {
-        variable_types[name] = type;
-        return type;
+    const Variable* find(Symbol name) const {
+        return variables().find(name);
+    }
+    const Variable* find(const string& name) const {
+        return find(symbols().find(name));
+    }
+    bool defined(Symbol name) const {
+        return (find(name) != nullptr);
+    }
+    bool defined(const string& name) const {
+        return (find(name) != nullptr);
     }
 
-    string valueof(const string& name, TokenVectorSize offset) {
-        if (variable_values.count(name)) {
-            return variable_values.at(name);
-        } else if (parent == nullptr) {
+    const Variable& lookup(Symbol name, TokenVectorSize offset) const {
+        const Variable* variable = find(name);
+        if (variable == nullptr) {
+            throw InvalidSyntax(offset, ("access to name not present in scope: " + (name == no_symbol ? string("") : symbols().name(name))));
+        }
+        return *variable;
+    }
+    const Variable& lookup(const string& name, TokenVectorSize offset) const {
+        const Variable* variable = find(name);
+        if (variable == nullptr) {
             throw InvalidSyntax(offset, ("access to name not present in scope: " + name));
-        } else {
-            return parent->valueof(name, offset);
         }
+        return *variable;
     }
 
-    string setvalueof(const string& name, const string& type) {
-        variable_values[name] = type;
-        return type;
+    unsigned registerof(Symbol name, TokenVectorSize offset) const {
+        return lookup(name, offset).register_index;
+    }
+    TypeID typeof(const string& name, TokenVectorSize offset) const {
+        return lookup(name, offset).type;
     }
 
-    bool isRegisteredClass(const string& s) {
-        return (s == "int" or s == "float" or s == "string" or s == "bool" or s == "auto");
+    void define(Symbol name, unsigned register_index, TypeID type, string_view value = "") {
+        variables().define(name, Variable { register_index, type, value });
+    }
+    void define(string_view name, unsigned register_index, TypeID type, string_view value = "") {
+        define(symbols().intern(name.data(), name.size()), register_index, type, value);
     }
 
     bool isDeclaredFunction(const string& s);
-    FunctionSignature getFunctionSignature(const string& s);
+    const FunctionSignature* findFunction(const string& s);
+    const FunctionSignature& getFunctionSignature(const string& s);
 
-    Scope(FunctionEnvironment *fn): parent(nullptr), function(fn) {}
-    Scope(Scope* scp): parent(scp), function(nullptr) {}
-    Scope(FunctionEnvironment *fn, Scope *scp): parent(scp), function(fn) {}
+    Scope(FunctionEnvironment *fn): parent(nullptr), function(fn) {
+        variables().enter();
+    }
+    Scope(FunctionEnvironment *fn, Scope *scp): parent(scp), function(fn) {
+        variables().enter();
+    }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+    ~Scope() {
+        variables().leave();
+    }
 };
 
-struct FunctionEnvironment {
-    vector<string> parameters;
-    map<string, string> parameter_types;
-    map<string, bool> parameter_var_length;
+enum class Opcode : unsigned char {
+    Name,       // .name: <target> <text>
+    Mark,       // .mark: <text>
+    Comment,    // ; <text>
+    Arg,        // arg <target> <number>
+    Izero,      // izero <target>
+    Istore,     // istore <target> <text>
+    Fstore,     // fstore <target> <text>
+    Strstore,   // strstore <target> <text>
+    Not,        // not <target> <source>
+    Function,   // function <target> <text>
+    Copy,       // copy <target> <source>
+    Move,       // move <target> <source>
+    Frame,      // frame with <number> parameters, which are the Param instructions following it
+    Param,      // (param <number> <source>)
+    Call,       // call <target> <text>
+    Tailcall,   // tailcall <text>
+    Branch,     // branch <source> +1 <text>
+    Jump,       // jump <text>
+    Return,     // return
+    Asm,        // inline assembly, <text> is written out verbatim
+    Inlined,    // assembly inlined from another function: <text>, then its <number> operands, which are the Operand instructions following it
+    Operand,    // <target> (the same register as <source>, as the assembly may both read and write it), then <text>
+};
 
-    string return_type;
-    bool automatic_return_type;
+const unsigned no_register = numeric_limits<unsigned>::max();
 
-    unsigned begin_balance;
-    string function_name;
+bool isDirective(Opcode opcode) {
+    /*  Directives (.name:, .mark: and comments) are not executed.
+     */
+    return (opcode == Opcode::Name or opcode == Opcode::Mark or opcode == Opcode::Comment);
+}
+
+struct Instruction {
+    Opcode opcode;
+    // register the instruction writes to (or names), and register it reads from
+    unsigned target;
+    unsigned source;
+    // index of argument or parameter, or number of parameters of a frame or operands of inlined assembly
+    unsigned number;
+    // literal, name, label or function operand
+    string_view text;
+    // the instruction is written around the one before it, which becomes its operand, e.g. "not (istore 1 0)"
+    bool nested;
+};
+
+class Code {
+    /*  Instructions of one function, in the order they are executed.
+     *
+     *  Code generation appends instructions here instead of writing assembly text, so that the
+     *  instructions can be inspected and rewritten (e.g. by the register allocator) before they are
+     *  written out by serialize().
+     *  Text operands are copied to the memory resource the code was given.
+     */
+    pmr::memory_resource* memory;
+    pmr::vector<Instruction> instructions;
+
+    string_view keep(string_view s) {
+        if (s.empty()) {
+            return s;
+        }
+        char* copy = static_cast<char*>(memory->allocate(s.size(), 1));
+        copy_n(s.data(), s.size(), copy);
+        return string_view(copy, s.size());
+    }
+
+    Code& emit(Opcode opcode, unsigned target, unsigned source, unsigned number, string_view text, bool nested = false) {
+        instructions.push_back(Instruction { opcode, target, source, number, keep(text), nested });
+        return *this;
+    }
+
+    static void write(ostream& output, const Instruction& each) {
+        /*  Writes the instruction without indentation and the terminating newline.
+         *  Nested instructions write only their opcode, as their operand is the instruction
+         *  they are written around.
+         */
+        switch (each.opcode) {
+            case Opcode::Name:
+                output << ".name: " << each.target << ' ' << each.text;
+                break;
+            case Opcode::Mark:
+                output << ".mark: " << each.text;
+                break;
+            case Opcode::Comment:
+                output << "; " << each.text;
+                break;
+            case Opcode::Arg:
+                output << "arg " << each.target << ' ' << each.number;
+                break;
+            case Opcode::Izero:
+                output << "izero " << each.target;
+                break;
+            case Opcode::Istore:
+                output << "istore " << each.target << ' ' << each.text;
+                break;
+            case Opcode::Fstore:
+                output << "fstore " << each.target << ' ' << each.text;
+                break;
+            case Opcode::Strstore:
+                output << "strstore " << each.target << ' ' << each.text;
+                break;
+            case Opcode::Not:
+                output << "not ";
+                if (not each.nested) {
+                    output << each.target << ' ' << each.source;
+                }
+                break;
+            case Opcode::Function:
+                output << "function " << each.target << ' ' << each.text;
+                break;
+            case Opcode::Copy:
+                output << "copy " << each.target << ' ' << each.source;
+                break;
+            case Opcode::Move:
+                output << "move " << each.target << ' ' << each.source;
+                break;
+            case Opcode::Frame:
+                output << "frame ";
+                break;
+            case Opcode::Param:
+                output << "(param " << each.number << ' ' << each.source << ')';
+                break;
+            case Opcode::Call:
+                output << "call " << each.target << ' ' << each.text;
+                break;
+            case Opcode::Tailcall:
+                output << "tailcall " << each.text;
+                break;
+            case Opcode::Branch:
+                output << "branch " << each.source << " +1 " << each.text;
+                break;
+            case Opcode::Jump:
+                output << "jump " << each.text;
+                break;
+            case Opcode::Return:
+                output << "return";
+                break;
+            case Opcode::Asm:
+            case Opcode::Inlined:
+                output << each.text;
+                break;
+            case Opcode::Operand:
+                output << each.target << each.text;
+                break;
+        }
+    }
+
+    public:
+        using size_type = pmr::vector<Instruction>::size_type;
+
+        size_type size() const {
+            return instructions.size();
+        }
+        Instruction& operator[](size_type i) {
+            return instructions[i];
+        }
+        const Instruction& operator[](size_type i) const {
+            return instructions[i];
+        }
+
+        Code& name(unsigned r, string_view n) {
+            return emit(Opcode::Name, r, no_register, 0, n);
+        }
+        Code& mark(string_view label) {
+            return emit(Opcode::Mark, no_register, no_register, 0, label);
+        }
+        Code& comment(string_view text) {
+            return emit(Opcode::Comment, no_register, no_register, 0, text);
+        }
+        Code& arg(unsigned r, unsigned index) {
+            return emit(Opcode::Arg, r, no_register, index, "");
+        }
+        Code& izero(unsigned r) {
+            return emit(Opcode::Izero, r, no_register, 0, "");
+        }
+        Code& store(Opcode opcode, unsigned r, string_view literal) {
+            /*  Emits istore, fstore or strstore of the literal.
+             */
+            return emit(opcode, r, no_register, 0, literal);
+        }
+        Code& boolean(unsigned r, bool value) {
+            /*  There is no boolean literal in the assembly, true is "not 0" and false is "not not 0".
+             */
+            emit(Opcode::Istore, r, no_register, 0, "0");
+            emit(Opcode::Not, r, r, 0, "", true);
+            if (not value) {
+                emit(Opcode::Not, r, r, 0, "", true);
+            }
+            return *this;
+        }
+        Code& function(unsigned r, string_view name) {
+            return emit(Opcode::Function, r, no_register, 0, name);
+        }
+        Code& copy(unsigned target, unsigned source) {
+            return emit(Opcode::Copy, target, source, 0, "");
+        }
+        Code& move(unsigned target, unsigned source) {
+            return emit(Opcode::Move, target, source, 0, "");
+        }
+        Code& frame(unsigned parameters) {
+            return emit(Opcode::Frame, no_register, no_register, parameters, "");
+        }
+        Code& param(unsigned index, unsigned source) {
+            return emit(Opcode::Param, no_register, source, index, "");
+        }
+        Code& call(unsigned r, string_view function) {
+            return emit(Opcode::Call, r, no_register, 0, function);
+        }
+        Code& branch(unsigned condition, string_view label) {
+            return emit(Opcode::Branch, no_register, condition, 0, label);
+        }
+        Code& jump(string_view label) {
+            return emit(Opcode::Jump, no_register, no_register, 0, label);
+        }
+        Code& ret() {
+            return emit(Opcode::Return, no_register, no_register, 0, "");
+        }
+        Code& assembly(string_view text) {
+            return emit(Opcode::Asm, no_register, no_register, 0, text);
+        }
+        Code& inlined(string_view text, unsigned operands) {
+            return emit(Opcode::Inlined, no_register, no_register, operands, text);
+        }
+        Code& operand(unsigned r, string_view text) {
+            return emit(Opcode::Operand, r, r, 0, text);
+        }
+        Code& append(const Instruction& each) {
+            /*  Appends a copy of the instruction; its text must already be kept by this code.
+             */
+            instructions.push_back(each);
+            return *this;
+        }
+
+        void serialize(ostream& output) const {
+            /*  Writes the instructions out as Viua assembly, one line per instruction.
+             *  Nested instructions share the line of the instruction they are written around, and
+             *  parameters of a frame share the line of the frame.
+             */
+            for (size_type i = 0; i < instructions.size();) {
+                const Instruction& each = instructions[i++];
+                size_type nesting = 0;
+                while ((i + nesting) < instructions.size() and instructions[i + nesting].nested) {
+                    ++nesting;
+                }
+
+                output << "    ";
+                for (size_type k = nesting; k > 0; --k) {
+                    write(output, instructions[i + k - 1]);
+                    output << '(';
+                }
+                write(output, each);
+                output << string(nesting, ')');
+                i += nesting;
+
+                if (each.opcode == Opcode::Frame) {
+                    if (each.number == 0) {
+                        output << '0';
+                    } else {
+                        output << "^[";
+                        for (unsigned p = 0; p < each.number; ++p) {
+                            write(output, instructions[i++]);
+                            if ((p + 1) < each.number) {
+                                output << ' ';
+                            }
+                        }
+                        output << ']';
+                    }
+                }
+                if (each.opcode == Opcode::Inlined) {
+                    for (unsigned p = 0; p < each.number; ++p) {
+                        write(output, instructions[i++]);
+                    }
+                }
+                output << '\n';
+            }
+        }
+
+        unsigned registers() const {
+            /*  Returns number of registers used, i.e. one more than the highest register operand.
+             */
+            unsigned n = 1;
+            for (const auto& each : instructions) {
+                for (unsigned r : { each.target, each.source }) {
+                    if (r != no_register) {
+                        n = max(n, (r + 1));
+                    }
+                }
+            }
+            return n;
+        }
+
+        void erase(const pmr::vector<bool>& removed) {
+            /*  Removes instructions flagged as removed, keeping the order of the rest.
+             */
+            size_type kept = 0;
+            for (size_type i = 0; i < instructions.size(); ++i) {
+                if (not removed[i]) {
+                    instructions[kept++] = instructions[i];
+                }
+            }
+            instructions.erase((instructions.begin() + static_cast<ptrdiff_t>(kept)), instructions.end());
+        }
+
+        Code(pmr::memory_resource* m): memory(m), instructions(m) {}
+};
+
+struct FunctionEnvironment {
+    /*  Memory for compiler state that lives only while the function is compiled.
+     *  Small functions fit in the initial buffer; whatever is allocated is released at once
+     *  when the environment is destroyed, also when compilation fails with an exception.
+     */
+    alignas(max_align_t) char arena_buffer[8192];
+    pmr::monotonic_buffer_resource arena;
+
+    // strings of the containers are allocated from the arena too
+    pmr::vector<pmr::string> parameters;
+    pmr::map<pmr::string, TypeID> parameter_types;
+
+    TypeID return_type;
+    bool automatic_return_type;
+
+    string function_name;
 
     bool has_returned;
     unsigned ifs;
 
     unsigned whiles;
-    string loop_begin;
-    string loop_end;
+    // labels of the innermost loop, empty outside of loops
+    string_view loop_begin;
+    string_view loop_end;
 
     CompilationEnvironment *env;
+    SymbolTable variables;
+    Scope outermost;
     Scope *scope;
 
+    // instructions of the body, written out once the whole function is compiled
+    Code code;
+
     string header(bool full = false) const {
         ostringstream oss;
         oss << function_name << '(';
         auto limit = (parameters.size()-1);
         for (vector<string>::size_type i = 0; i < parameters.size(); ++i) {
-            oss << parameter_types.at(parameters[i]);
+            oss << env->types.name(parameter_types.at(parameters[i]));
             if (full) {
                 oss << ' ' << parameters[i];
             }
@@ -921,175 +2386,431 @@ struct FunctionEnvironment {
                 oss << ", ";
             }
         }
-        oss << ")->" << (automatic_return_type ? "auto" : return_type);
+        oss << ")->" << (automatic_return_type ? "auto" : env->types.name(return_type));
         return oss.str();
     }
 
+    string_view label(string_view kind, unsigned n) {
+        /*  Returns label of the function, e.g. "__main_if_0".
+         *  Labels are allocated from the arena, so they stay valid until the function is compiled.
+         *  The number is formatted as support::str::stringify() formats it, newline included, so
+         *  that the generated assembly does not change.
+         */
+        char digits[16];
+        auto length = static_cast<string::size_type>(to_chars(begin(digits), end(digits), n).ptr - digits);
+        digits[length++] = '\n';
+        string::size_type size = (2 + function_name.size() + kind.size() + length);
+        char* text = static_cast<char*>(arena.allocate(size, 1));
+        char* p = copy_n("__", 2, text);
+        p = copy_n(function_name.data(), function_name.size(), p);
+        p = copy_n(kind.data(), kind.size(), p);
+        copy_n(digits, length, p);
+        return string_view(text, size);
+    }
+
     FunctionEnvironment(const string& s, CompilationEnvironment* ce):
+        arena(arena_buffer, sizeof(arena_buffer)),
+        parameters(&arena),
+        parameter_types(&arena),
+        return_type(no_type),
         automatic_return_type(false),
-        begin_balance(0),
         function_name(s),
         has_returned(false),
         ifs(0),
         whiles(0),
-        loop_begin(""),
-        loop_end(""),
+        loop_begin(),
+        loop_end(),
         env(ce),
-        scope(new Scope(this))
+        variables(&arena),
+        outermost(this),
+        scope(&outermost),
+        code(&arena)
     {
         }
-    ~FunctionEnvironment() {
-        delete scope;
-    }
 };
 
+Interner& Scope::symbols() const {
+    return *function->env->symbols;
+}
+
+TypeTable& Scope::types() const {
+    return function->env->types;
+}
+
+SymbolTable& Scope::variables() const {
+    return function->variables;
+}
+
 bool Scope::isDeclaredFunction(const string& s) {
-    return (function->env->signatures.count(s) or function->env->signatures.count("::" + s));
+    return (findFunction(s) != nullptr);
 }
 
-FunctionSignature Scope::getFunctionSignature(const string& s) {
-    if (function->env->signatures.count(s)) {
-        return function->env->signatures.at(s);
-    } else {
-        return function->env->signatures.at("::" + s);
+const FunctionSignature* Scope::findFunction(const string& s) {
+    return function->env->signatures.resolve(s);
+}
+
+const FunctionSignature& Scope::getFunctionSignature(const string& s) {
+    const FunctionSignature* signature = findFunction(s);
+    if (signature == nullptr) {
+        throw out_of_range("no signature for function: " + s);
     }
+    return *signature;
 }
 
 
-vector<Token> removeComments(const vector<Token>& tks) {
-    vector<Token> tokens;
+class NormalizationRule {
+    /*  One rewrite rule of the token normalization pipeline.
+     *
+     *  Tokens are fed to a rule one at a time and the rule passes its output down to the next rule.
+     *  A rule remembers the last two tokens it was fed, and keeps the last few tokens it produced
+     *  pending so it can retract them before they are passed on.
+     *  All rules share the output vector, which owns text of synthesized tokens.
+     */
+    NormalizationRule* next;
+    vector<Token> pending;
+    vector<Token>::size_type pending_limit;
+    Token previous_tokens[2];
+    TokenVectorSize fed_tokens;
+
+    protected:
+        TokenVector& tokens;
+
+        void push(const Token& t) {
+            pending.push_back(t);
+            if (pending.size() > pending_limit) {
+                next->feed(pending.front());
+                pending.erase(pending.begin());
+            }
+        }
+        void pop() {
+            pending.pop_back();
+        }
+        // n-th most recently produced token that is still pending, counting from 1
+        bool produced(unsigned n, TokenKind k) const {
+            return (pending.size() >= n and pending[pending.size()-n].kind() == k);
+        }
+
+        // n-th token fed before the current one, counting from 1
+        const Token& previous(unsigned n) const {
+            return previous_tokens[n-1];
+        }
+        TokenVectorSize fed() const {
+            return fed_tokens;
+        }
+
+        virtual void rewrite(const Token& t) = 0;
+        virtual void drain() {}
+
+    public:
+        void feed(const Token& t) {
+            rewrite(t);
+            previous_tokens[1] = previous_tokens[0];
+            previous_tokens[0] = t;
+            ++fed_tokens;
+        }
+        virtual bool holdsSynthesized() const {
+            for (const auto& each : pending) {
+                if (each.isSynthesized()) {
+                    return true;
+                }
+            }
+            return (previous_tokens[0].isSynthesized() or previous_tokens[1].isSynthesized());
+        }
+        virtual void finish() {
+            drain();
+            for (const auto& each : pending) {
+                next->feed(each);
+            }
+            pending.clear();
+            if (next) {
+                next->finish();
+            }
+        }
+
+        void chain(NormalizationRule* n) {
+            next = n;
+        }
 
-    Token token, previous_token;
-    for (vector<string>::size_type i = 0; i < tks.size(); ++i) {
-        token = tks[i];
+        NormalizationRule(TokenVector& tv, vector<Token>::size_type limit):
+            next(nullptr), pending_limit(limit), fed_tokens(0), tokens(tv) {
+            pending.reserve(limit+1);
+        }
+        virtual ~NormalizationRule() {}
+};
 
-        if (token == "/" and previous_token == "/") {
+class RemoveComments: public NormalizationRule {
+    /*  Removes "// ..." comments (with terminating newline) and "/ * ... * /" comments.
+     */
+    enum class State { Code, LineComment, BlockComment } state;
+    Token previous_token;
+    bool has_previous_token;
+    Token previous_in_comment;
+    bool has_previous_in_comment;
+
+    void rewrite(const Token& token) override {
+        if (state == State::LineComment) {
             // double-slash comments go until the first newline
-            while (++i < tks.size() and tks[i] != "\n");
-            // last pushed token has to be removed as it is the starting "/"
-            tokens.pop_back();
-            continue;
+            if (token.kind() == TokenKind::Newline) {
+                state = State::Code;
+            }
+            return;
         }
-        if (token == "*" and previous_token == "/") {
+        if (state == State::BlockComment) {
             // block comments go from "/*" to "*/"
+            if (has_previous_in_comment and previous_in_comment.kind() == TokenKind::Star and token.kind() == TokenKind::Slash) {
+                state = State::Code;
+            }
+            previous_in_comment = token;
+            has_previous_in_comment = true;
+            return;
+        }
+
+        bool previous_is_slash = (has_previous_token and previous_token.kind() == TokenKind::Slash);
+        if (previous_is_slash and (token.kind() == TokenKind::Slash or token.kind() == TokenKind::Star)) {
             // last pushed token has to be removed as it is the starting "/"
-            tokens.pop_back();
-            // skip the "*" of comment opening
-            ++i;
-            while (++i < tks.size() and not (tks[i-1] == "*" and tks[i] == "/"));
-            continue;
+            pop();
+            state = (token.kind() == TokenKind::Slash ? State::LineComment : State::BlockComment);
+            has_previous_in_comment = false;
+            has_previous_token = false;
+            return;
         }
 
         previous_token = token;
-        tokens.push_back(token);
+        has_previous_token = true;
+        push(token);
     }
 
-    return tokens;
-}
+    public:
+        bool holdsSynthesized() const override {
+            return (NormalizationRule::holdsSynthesized() or previous_token.isSynthesized() or previous_in_comment.isSynthesized());
+        }
 
-vector<Token> removeNewlines(const vector<Token>& tks) {
-    vector<Token> tokens;
+        RemoveComments(TokenVector& tv):
+            NormalizationRule(tv, 1),
+            state(State::Code),
+            has_previous_token(false),
+            has_previous_in_comment(false) {
+        }
+};
 
-    Token token;
-    for (vector<string>::size_type i = 0; i < tks.size(); ++i) {
-        token = tks[i];
-        if (token == "\n") {
-            continue;
+class RemoveNewlines: public NormalizationRule {
+    void rewrite(const Token& token) override {
+        if (token.kind() != TokenKind::Newline) {
+            push(token);
         }
-        tokens.push_back(token);
     }
 
-    return tokens;
-}
+    public:
+        RemoveNewlines(TokenVector& tv): NormalizationRule(tv, 0) {}
+};
 
-vector<Token> reduceIntegers(const vector<Token>& tks) {
-    vector<Token> tokens;
+class ReduceIntegers: public NormalizationRule {
+    /*  "=" "-" "42" -> "=" "-42"
+     */
+    void rewrite(const Token& token) override {
+        if (fed() >= 2 and previous(1).kind() == TokenKind::Minus and previous(2).kind() == TokenKind::Equals and token.kind() == TokenKind::Integer) {
+            Token reduced = token;
+            tokens.textprepend(reduced, "-");
+            pop();
+            push(reduced);
+            return;
+        }
+        push(token);
+    }
 
-    Token token;
-    for (vector<string>::size_type i = 0; i < tks.size(); ++i) {
-        token = tks[i];
-        if (support::str::isnum(token) and i) {
-            if (i >= 2 and tks[i-1] == "-" and tks[i-2] == "=") {
-                tokens.pop_back();
-                token.textprepend("-");
-            }
+    public:
+        ReduceIntegers(TokenVector& tv): NormalizationRule(tv, 1) {}
+};
+
+class ReduceFloats: public NormalizationRule {
+    /*  "3" "." "14" -> "3.14"
+     */
+    void rewrite(const Token& token) override {
+        if (fed() >= 2 and previous(1).kind() == TokenKind::Dot and token.kind() == TokenKind::Integer and previous(2).kind() == TokenKind::Integer) {
+            Token reduced = token;
+            // prepended piece by piece so that the token stays a span of the source
+            tokens.textprepend(reduced, ".");
+            tokens.textprepend(reduced, tokens.view(previous(2)));
+            tokens.kind(reduced, TokenKind::Float);
+            pop();
+            pop();
+            push(reduced);
+            return;
         }
-        tokens.push_back(token);
+        push(token);
     }
-    return tokens;
-}
 
-vector<Token> reduceFloats(const vector<Token>& tks) {
-    vector<Token> tokens;
+    public:
+        ReduceFloats(TokenVector& tv): NormalizationRule(tv, 2) {}
+};
 
-    Token token;
-    for (vector<string>::size_type i = 0; i < tks.size(); ++i) {
-        token = tks[i];
-        if (support::str::isnum(token) and i) {
-            if (i >= 2 and tks[i-1] == "." and support::str::isnum(tks[i-2])) {
-                token.textprepend(tks[i-2].text() + ".");
-                tokens.pop_back();
-                tokens.pop_back();
-            }
+class ReduceNamespaceResolutionOperator: public NormalizationRule {
+    /*  ":" ":" -> "::"
+     */
+    void rewrite(const Token& token) override {
+        if (fed() >= 1 and token.kind() == TokenKind::Colon and previous(1).kind() == TokenKind::Colon) {
+            Token reduced = token;
+            tokens.textprepend(reduced, ":");
+            tokens.kind(reduced, TokenKind::ResolutionOperator);
+            pop();
+            push(reduced);
+            return;
         }
-        tokens.push_back(token);
+        push(token);
     }
-    return tokens;
-}
 
-vector<Token> reduceVariableLengthOperator(const vector<Token>& tks) {
-    vector<Token> tokens;
+    public:
+        ReduceNamespaceResolutionOperator(TokenVector& tv): NormalizationRule(tv, 1) {}
+};
 
-    Token token;
-    for (vector<string>::size_type i = 0; i < tks.size(); ++i) {
-        token = tks[i];
-        if (token == "." and i) {
-            if (i >= 2 and tks[i-1] == "." and tks[i-2] == ".") {
-                token.textprepend("..");
-                tokens.pop_back();
-                tokens.pop_back();
+class ReduceNamespacedNames: public NormalizationRule {
+    /*  "foo" "::" "bar" -> "foo::bar"
+     *
+     *  This rule needs to look ahead so it holds a name (and the "::" following it) until
+     *  it knows whether the next token extends the name.
+     */
+    Token name;
+    Token resolution_operator;
+    enum class State { Empty, Name, NameAndOperator } state;
+
+    bool isName(const Token& token) const {
+        // only interned words can be names
+        return (token.symbol() != no_symbol and support::str::isname(tokens.view(token)));
+    }
+
+    void rewrite(const Token& token) override {
+        if (state == State::Name) {
+            if (token.kind() == TokenKind::ResolutionOperator) {
+                resolution_operator = token;
+                state = State::NameAndOperator;
+                return;
+            }
+            push(name);
+            state = State::Empty;
+        } else if (state == State::NameAndOperator) {
+            if (isName(token)) {
+                tokens.text(name, (tokens.text(name) + "::" + tokens.text(token)));
+                tokens.intern(name);
+                tokens.kind(name, TokenKind::Identifier);
+                state = State::Name;
+                return;
             }
+            push(name);
+            push(resolution_operator);
+            state = State::Empty;
+        }
+
+        if (isName(token)) {
+            name = token;
+            state = State::Name;
+        } else {
+            push(token);
         }
-        tokens.push_back(token);
     }
-    return tokens;
-}
+    void drain() override {
+        if (state != State::Empty) {
+            push(name);
+        }
+        if (state == State::NameAndOperator) {
+            push(resolution_operator);
+        }
+        state = State::Empty;
+    }
 
-vector<Token> reduceNamespaceResolutionOperator(const vector<Token>& tks) {
-    vector<Token> tokens;
+    public:
+        bool holdsSynthesized() const override {
+            return (NormalizationRule::holdsSynthesized() or (state != State::Empty and name.isSynthesized()));
+        }
 
-    Token token;
-    for (vector<string>::size_type i = 0; i < tks.size(); ++i) {
-        token = tks[i];
-        if (token == ":" and i) {
-            if (tks[i-1] == ":") {
-                token.text("::");
-                tokens.pop_back();
-            }
+        ReduceNamespacedNames(TokenVector& tv): NormalizationRule(tv, 0), state(State::Empty) {}
+};
+
+class ReduceVariableLengthOperator: public NormalizationRule {
+    /*  "." "." "." -> "..."
+     *
+     *  Matched against produced (not fed) tokens so that runs of more than three dots
+     *  do not retract tokens that were already reduced.
+     */
+    void rewrite(const Token& token) override {
+        if (token.kind() == TokenKind::Dot and produced(1, TokenKind::Dot) and produced(2, TokenKind::Dot)) {
+            Token reduced = token;
+            tokens.textprepend(reduced, "..");
+            tokens.kind(reduced, TokenKind::Ellipsis);
+            pop();
+            pop();
+            push(reduced);
+            return;
         }
+        push(token);
+    }
+
+    public:
+        ReduceVariableLengthOperator(TokenVector& tv): NormalizationRule(tv, 2) {}
+};
+
+class CollectTokens: public NormalizationRule {
+    void rewrite(const Token& token) override {
         tokens.push_back(token);
     }
-    return tokens;
-}
 
-vector<Token> reduceNamespacedNames(const vector<Token>& tks) {
-    vector<Token> tokens;
+    public:
+        CollectTokens(TokenVector& tv): NormalizationRule(tv, 0) {}
+};
 
-    Token token;
-    for (vector<string>::size_type i = 0; i < tks.size(); ++i) {
-        token = tks[i];
-        if (support::str::isname(token)) {
-            while (i < (tks.size()-2)) {
-                if (tks[i+1] == "::" and support::str::isname(tks[i+2])) {
-                    token.text(token.text() + "::" + tks[i+2].text());
-                    i += 2;
-                } else {
-                    break;
+class TokenNormalizer {
+    /*  Pipeline of normalization rules.
+     *
+     *  New rewrite rules are added by appending them to the pipeline below;
+     *  every rule sees the output of the rules before it.
+     */
+    vector<unique_ptr<NormalizationRule>> pipeline;
+
+    public:
+        void feed(const Token& token) {
+            pipeline.front()->feed(token);
+        }
+        void finish() {
+            pipeline.front()->finish();
+        }
+        bool holdsSynthesized() const {
+            /*  Returns true if any rule still keeps a synthesized token.
+             */
+            for (const auto& rule : pipeline) {
+                if (rule->holdsSynthesized()) {
+                    return true;
                 }
             }
+            return false;
         }
-        tokens.push_back(token);
+
+        TokenNormalizer(TokenVector& output) {
+            pipeline.emplace_back(new RemoveComments(output));
+            pipeline.emplace_back(new RemoveNewlines(output));
+            pipeline.emplace_back(new ReduceIntegers(output));
+            pipeline.emplace_back(new ReduceFloats(output));
+            pipeline.emplace_back(new ReduceNamespaceResolutionOperator(output));
+            pipeline.emplace_back(new ReduceNamespacedNames(output));
+            pipeline.emplace_back(new ReduceVariableLengthOperator(output));
+            pipeline.emplace_back(new CollectTokens(output));
+
+            for (decltype(pipeline)::size_type i = 1; i < pipeline.size(); ++i) {
+                pipeline[i-1]->chain(pipeline[i].get());
+            }
+        }
+};
+
+TokenVector normalize(const TokenVector& tks) {
+    /*  Runs all normalization rules over the token stream in a single pass.
+     */
+    TokenVector tokens = tks.derive();
+    tokens.reserve(tks.size());
+
+    TokenNormalizer normalizer(tokens);
+    for (TokenVectorSize i = 0; i < tks.size(); ++i) {
+        normalizer.feed(tks.at(i));
     }
+    normalizer.finish();
+
     return tokens;
 }
 
@@ -1102,645 +2823,2322 @@ vector<string> mapStringVector(const vector<string>& sv, string(*fn)(const strin
 }
 
 
-string inferType(const string& var_value) {
-    string var_type;
+TypeID inferType(const string& var_value) {
+    /*  Returns type of literal, or no_type if the value is not a literal.
+     */
+    TypeID var_type = no_type;
     if (support::str::isnum(var_value)) {
-        var_type = "int";
+        var_type = TypeTable::int_type;
     } else if (var_value.size() >= 2 and var_value[0] == '"' and var_value[var_value.size()-1] == '"') {
-        var_type = "string";
+        var_type = TypeTable::string_type;
     } else if (var_value.size() >= 2 and var_value[0] == '\'' and var_value[var_value.size()-1] == '\'') {
-        var_type = "string";
+        var_type = TypeTable::string_type;
     } else if (support::str::isbooleanliteral(var_value)) {
-        var_type = "bool";
+        var_type = TypeTable::bool_type;
     }
     return var_type;
 }
 
 
-TokenVectorSize processVariable(const TokenVector& tokens, TokenVectorSize offset, Scope* scope, ostringstream& output) {
-    TokenVectorSize i = offset;
-    string var_name = "", var_type = "", var_value = "";
-    unsigned var_register = 0;
-
-    var_type = tokens[i];
-    var_name = tokens[++i];
-
-    if (not support::str::isname(var_name)) {
-        throw InvalidSyntax(i-1, ("invalid variable name in function " + scope->function->header() + ": " + var_name));
-    }
-
-    // never store in register 0, if the value is not for return
-    var_register = scope->size()+1;
-
-    ++i;
+using NodeIndex = uint32_t;
+const NodeIndex no_node = numeric_limits<NodeIndex>::max();
+// columns that hold token indices use their own marker for "no token"
+const uint32_t no_token = numeric_limits<uint32_t>::max();
+
+enum class NodeKind : unsigned char {
+    Function,
+    Parameter,
+    Block,
+    If,
+    While,
+    Variable,
+    Return,
+    Asm,
+    Break,
+    Call,
+    Assignment,
+    Argument,
+    Error,
+};
 
-    output << "    .name: " << var_register << ' ' << var_name << '\n';
+class SyntaxTree {
+    /*  Abstract syntax tree of the program, built once by the parser and walked by code generation.
+     *
+     *  Nodes are stored column by column (structure of arrays) in vectors that only grow, and refer
+     *  to each other and to the tokens they were parsed from by 32-bit indices.
+     *  Children of a node form a list: the first child is held in the lhs column, and each child
+     *  links to the next one through the next column.
+     *
+     *  Token of a node is the one diagnostics about the node point at, and end is the last token
+     *  of the construct.
+     *  Meaning of the lhs and rhs columns depends on kind of the node:
+     *
+     *      Function    token: name; lhs: parameters followed by the body, if the function is defined;
+     *                  rhs: return type (token), or no_token; end: closing ")" of the parameter list
+     *      Parameter   token: type; lhs: name (token); rhs: "..." (token) of variable-length parameter, or no_token
+     *      Block       token: opening "{"; lhs: statements; end: closing "}"
+     *      If, While   token: condition variable; lhs: the block, or the error found instead of it
+     *      Variable    token: type; lhs: name (token); rhs: value (token), or no_token; end: terminating ";"
+     *      Return      token: returned value, or ";"; lhs: returned value (token), or no_token
+     *      Asm         token: "asm"; end: terminating ";"
+     *      Break       token: "break"
+     *      Call        token: callee; lhs: arguments; end: token that ended the argument list
+     *      Assignment  token: variable receiving result of the call; lhs: the call
+     *      Argument    token: name or literal passed; lhs: nested call whose result is passed, or no_node
+     *      Error       token: where parsing stopped; lhs: index of the message
+     */
+    const TokenVector* source;
+
+    vector<NodeKind> kinds;
+    vector<uint32_t> main_tokens;
+    vector<uint32_t> end_tokens;
+    vector<uint32_t> lefts;
+    vector<uint32_t> rights;
+    vector<NodeIndex> nexts;
+    vector<string> messages;
 
-    if (tokens[i] == ";") {
-        if (var_type == "int") {
-            var_value = "0";
-        } else if (var_type == "string") {
-            var_value = "''";
-        } else if (var_type == "float") {
-            var_value = "0.0";
-        } else if (var_type == "bool") {
-            var_value = "false";
-        } else if (var_type == "auto") {
-            throw InvalidSyntax(i, ("unable to determine type of variable " + var_name + " in definition of function " +
-                        scope->function->header() + "; 'auto' cannot be used without initialisation"));
-        } else {
-            throw InvalidSyntax(i, ("invalid type of variable " + var_name + " in definition of function " +
-                        scope->function->header() + ": " + var_type));
+    public:
+        const TokenVector& tokens() const {
+            return *source;
         }
-    } else if (tokens[i] == "=") {
-        var_value = tokens[++i];
-        // skip terminating ";"
-        ++i;
-    }
 
-    if (scope->defined(var_value) and scope->typeof(var_value, i) == var_type) {
-        output << "    copy " << var_register << ' ' << scope->registerof(var_value, i) << endl;
-    } else if (scope->defined(var_value) and scope->typeof(var_value, i) != var_type and var_type == "auto") {
-        var_type = scope->typeof(var_value, i);
-        output << "    copy " << var_register << ' ' << scope->registerof(var_value, i) << endl;
-    } else if (scope->isDeclaredFunction(var_value) and var_type == "auto") {
-        var_type = scope->getFunctionSignature(var_value).typeof();
-        output << "    function " << var_register << ' ' << var_value << endl;
-    } else if (scope->defined(var_value) and scope->typeof(var_value, i) != var_type) {
-        throw InvalidSyntax(i, ("cannot convert from " + scope->typeof(var_value, i) + " to " + var_type +
-                    " in initialisation"));
-    } else {
-        output << "    ";
-        if (var_type == "auto") {
-            if ((var_type = inferType(var_value)).size() == 0) {
-                throw InvalidSyntax(offset, ("failed to determine type of auto variable " +
-                            var_name + " in function " + scope->function->header() + ": " + var_value));
+        NodeIndex add(NodeKind kind, TokenVectorSize token, uint32_t lhs = no_node, uint32_t rhs = no_node) {
+            kinds.push_back(kind);
+            main_tokens.push_back(static_cast<uint32_t>(token));
+            end_tokens.push_back(static_cast<uint32_t>(token));
+            lefts.push_back(lhs);
+            rights.push_back(rhs);
+            nexts.push_back(no_node);
+            return static_cast<NodeIndex>(kinds.size() - 1);
+        }
+        NodeIndex error(TokenVectorSize token, const string& message) {
+            messages.push_back(message);
+            return add(NodeKind::Error, token, static_cast<uint32_t>(messages.size() - 1));
+        }
+        NodeIndex append(NodeIndex parent, NodeIndex last, NodeIndex child) {
+            /*  Appends child after last child of the parent (no_node if it has no children yet).
+             *  Returns the appended child, which becomes the last one.
+             */
+            if (last == no_node) {
+                lefts[parent] = child;
+            } else {
+                nexts[last] = child;
             }
+            return child;
         }
-        if (var_type == "int") {
-            output << "istore";
-        } else if (var_type == "string") {
-            output << "strstore";
-        } else if (var_type == "float") {
-            output << "fstore";
-        } else if (var_type == "bool") {
-            // explicitly do nothing
-        } else if (var_type == "auto") {
-            // explicitly do nothing
+
+        NodeKind kind(NodeIndex n) const {
+            return kinds[n];
+        }
+        TokenVectorSize token(NodeIndex n) const {
+            return main_tokens[n];
+        }
+        TokenVectorSize end(NodeIndex n) const {
+            return end_tokens[n];
+        }
+        uint32_t lhs(NodeIndex n) const {
+            return lefts[n];
+        }
+        uint32_t rhs(NodeIndex n) const {
+            return rights[n];
+        }
+        NodeIndex next(NodeIndex n) const {
+            return nexts[n];
+        }
+        const string& message(NodeIndex n) const {
+            return messages[lefts[n]];
+        }
+
+        void end(NodeIndex n, TokenVectorSize token) {
+            end_tokens[n] = static_cast<uint32_t>(token);
+        }
+        void lhs(NodeIndex n, uint32_t value) {
+            lefts[n] = value;
+        }
+        void rhs(NodeIndex n, uint32_t value) {
+            rights[n] = value;
+        }
+
+        NodeIndex size() const {
+            return static_cast<NodeIndex>(kinds.size());
+        }
+        void clear() {
+            kinds.clear();
+            main_tokens.clear();
+            end_tokens.clear();
+            lefts.clear();
+            rights.clear();
+            nexts.clear();
+            messages.clear();
+        }
+
+        SyntaxTree(const TokenVector& t): source(&t) {}
+};
+
+class Parser {
+    /*  Parses functions into the syntax tree.
+     *
+     *  The grammar is not context-free in two places: parameter and return types must name known types,
+     *  and in an argument list a name followed by "(" is a nested call only if it names a declared function.
+     *  Functions are thus parsed in order of declaration, and the parser declares signature of each
+     *  function before parsing its body.
+     *
+     *  Syntax errors in a body are recorded in the tree as Error nodes and parsing of the body stops there.
+     *  The error is reported when code generation reaches it, so that diagnostics come in the order of
+     *  the source, as they would if the function was compiled while being parsed.
+     *  Blocks are parsed with an explicit stack, so deeply nested code does not exhaust the native stack.
+     */
+    const TokenVector& tokens;
+    CompilationEnvironment& cenv;
+    SyntaxTree& tree;
+
+    // signature of the function being parsed, for diagnostics
+    const FunctionSignature* declared;
+    // set when an error is recorded in the body being parsed
+    bool failed;
+
+    struct OpenBlock {
+        NodeIndex block;
+        NodeIndex last;
+        // tokens skipped after the closing "}" before the next statement
+        TokenVectorSize skip;
+    };
+    // blocks being parsed, innermost last; kept between functions to reuse its memory
+    vector<OpenBlock> blocks;
+
+    bool isRegisteredClass(const string& s) const {
+        // "void" is only implied by a missing return type
+        TypeID t = cenv.types.find(s);
+        return (t != no_type and t <= TypeTable::auto_type);
+    }
+
+    NodeIndex fail(TokenVectorSize i, const string& message) {
+        failed = true;
+        return tree.error(i, message);
+    }
+
+    TokenVectorSize parseFrame(NodeIndex call, TokenVectorSize offset, bool nested) {
+        /*  Parses arguments of the call, starting with the token after "(".
+         *  Arguments of a call nested in an argument list end at the first ")" or "," in place of an argument,
+         *  other argument lists at the first ";".
+         *  Returns number of processed tokens.
+         */
+        TokenVectorSize i = offset;
+
+        if (tokens[i] == ")") {
+            tree.end(call, i);
+            return 2; // number of processed tokens is 2: "(" and ";"
+        }
+
+        NodeIndex last = no_node;
+        for (; i < tokens.size() and (nested ? (not (tokens[i] == ")" or tokens[i] == ",")) : (tokens[i] != ";")); ++i) {
+            if (tokens[i] == ")") {
+                tree.append(call, last, fail(i, ("unexpected end of parameter list in call to function `" + tokens[tree.token(call)].text() + "`")));
+                return (i - offset);
+            }
+            NodeIndex argument = tree.add(NodeKind::Argument, i);
+            last = tree.append(call, last, argument);
+
+            if (support::str::isname(tokens[i]) and cenv.signatures.resolve(tokens[i]) != nullptr and tokens[i+1] == "(") {
+                NodeIndex nested_call = tree.add(NodeKind::Call, i);
+                tree.lhs(argument, nested_call);
+                // skip name of the function and opening "("
+                i += parseFrame(nested_call, (i + 2), true);
+            }
+
+            // account for both "," between parameters and
+            // closing ")"
+            ++i;
+        }
+        tree.end(call, i);
+
+        // skip terminating ";"
+        ++i;
+
+        return (i - offset);
+    }
+
+    NodeIndex parseVariable(TokenVectorSize& i) {
+        TokenVectorSize type = (i + 1);
+        TokenVectorSize name = (i + 2);
+        if (not support::str::isname(tokens[name])) {
+            return fail(type, ("invalid variable name in function " + declared->header() + ": " + tokens[name].text()));
+        }
+
+        NodeIndex variable = tree.add(NodeKind::Variable, type, static_cast<uint32_t>(name), no_token);
+        if (tokens[name+1].kind() == TokenKind::Semicolon) {
+            tree.end(variable, (name + 1));
+            i = (name + 2);
+        } else if (tokens[name+1].kind() == TokenKind::Equals) {
+            tree.rhs(variable, static_cast<uint32_t>(name + 2));
+            // the token after value terminates the definition
+            tree.end(variable, (name + 3));
+            i = (name + 4);
         } else {
-            throw InvalidSyntax(offset, ("invalid type of variable " +
-                        var_name + " in function " + scope->function->header() + ": " + var_value));
+            return fail((name + 1), ("expected '=' or ';' after name of variable " + tokens[name].text() + " in definition of function " + declared->header()));
+        }
+        return variable;
+    }
+
+    NodeIndex parseReturn(TokenVectorSize& i) {
+        // skip "return" keyword
+        ++i;
+
+        // this if deals with `return ;` case
+        if (tokens[i].kind() == TokenKind::Semicolon) {
+            return tree.add(NodeKind::Return, i++, no_token);
+        }
+
+        NodeIndex statement = tree.add(NodeKind::Return, i, static_cast<uint32_t>(i));
+        // advance after the returned <token>, and the terminating ";"
+        tree.end(statement, (i + 1));
+        i += 2;
+        return statement;
+    }
+
+    NodeIndex parseAsm(TokenVectorSize& i) {
+        NodeIndex statement = tree.add(NodeKind::Asm, i);
+        while (tokens[++i].kind() != TokenKind::Semicolon) {
+        }
+        tree.end(statement, i++);
+        return statement;
+    }
+
+    NodeIndex parseCall(TokenVectorSize& i) {
+        NodeIndex call = tree.add(NodeKind::Call, i);
+        // skip name of the function and opening "(", and advance past the token ending the statement
+        i += (parseFrame(call, (i + 2), false) + 1);
+        return call;
+    }
+
+    NodeIndex parseAssignment(TokenVectorSize& i) {
+        NodeIndex assignment = tree.add(NodeKind::Assignment, i);
+        NodeIndex call = tree.add(NodeKind::Call, (i + 2));
+        tree.lhs(assignment, call);
+        // skip the variable, "=", name of the function and opening "(", and advance past the terminating ";"
+        i += (parseFrame(call, (i + 4), false) + 4);
+        return assignment;
+    }
+
+    NodeIndex parseBody(TokenVectorSize& i) {
+        /*  Parses body of a function, starting with the token after its opening "{".
+         *  Afterwards i is the index of the closing "}" of the body, or the number of tokens if they ran out first.
+         */
+        NodeIndex body = tree.add(NodeKind::Block, (i - 1));
+        blocks.clear();
+        blocks.push_back(OpenBlock { body, no_node, 0 });
+        failed = false;
+
+        while (not failed and i < tokens.size()) {
+            OpenBlock& open = blocks.back();
+            switch (tokens[i].kind()) {
+                case TokenKind::Var:
+                    open.last = tree.append(open.block, open.last, parseVariable(i));
+                    break;
+                case TokenKind::Return:
+                    open.last = tree.append(open.block, open.last, parseReturn(i));
+                    break;
+                case TokenKind::Asm:
+                    open.last = tree.append(open.block, open.last, parseAsm(i));
+                    break;
+                case TokenKind::Semicolon:
+                    ++i;
+                    break;
+                case TokenKind::LeftBrace: {
+                    NodeIndex block = tree.add(NodeKind::Block, i++);
+                    open.last = tree.append(open.block, open.last, block);
+                    // skip closing "}" for nested blocks, and the token following it
+                    blocks.push_back(OpenBlock { block, no_node, 2 });
+                    break;
+                }
+                case TokenKind::RightBrace:
+                    tree.end(open.block, i);
+                    if (blocks.size() == 1) {
+                        return body;
+                    }
+                    i += open.skip;
+                    blocks.pop_back();
+                    break;
+                case TokenKind::Break:
+                    open.last = tree.append(open.block, open.last, tree.add(NodeKind::Break, i++));
+                    break;
+                case TokenKind::If:
+                case TokenKind::While: {
+                    bool is_if = (tokens[i].kind() == TokenKind::If);
+                    TokenVectorSize condition = (i + 1);
+                    if (not support::str::isname(tokens[condition])) {
+                        string spelling = (is_if ? support::str::strencode(tokens[condition].text()) : tokens[condition].text());
+                        open.last = tree.append(open.block, open.last, fail(condition, ("unexpected token in condition experssion: " + spelling)));
+                        break;
+                    }
+                    NodeIndex statement = tree.add((is_if ? NodeKind::If : NodeKind::While), condition);
+                    open.last = tree.append(open.block, open.last, statement);
+                    if (tokens[condition+1].kind() != TokenKind::LeftBrace) {
+                        tree.lhs(statement, fail((condition + 1), ("missing opening '{' in " + string(is_if ? "if" : "while") + "-statement in function " + declared->header())));
+                        break;
+                    }
+                    NodeIndex block = tree.add(NodeKind::Block, (condition + 1));
+                    tree.lhs(statement, block);
+                    // skip closing "}"
+                    blocks.push_back(OpenBlock { block, no_node, 1 });
+                    i = (condition + 2);
+                    break;
+                }
+                default:
+                    if ((i+3) >= tokens.size()) {
+                        open.last = tree.append(open.block, open.last, fail(i, ("missing tokens during call to " + tokens[i].text())));
+                    } else if (tokens[i+1].kind() == TokenKind::LeftParen) {
+                        open.last = tree.append(open.block, open.last, parseCall(i));
+                    } else if (tokens[i+1].kind() == TokenKind::Equals and tokens[i+3].kind() == TokenKind::LeftParen) {
+                        open.last = tree.append(open.block, open.last, parseAssignment(i));
+                    } else {
+                        open.last = tree.append(open.block, open.last, fail(i, ("unexpected token: " + support::str::strencode(tokens[i]))));
+                    }
+            }
+        }
+
+        return body;
+    }
+
+    public:
+        const SyntaxTree& syntax() const {
+            return tree;
         }
-        if (var_type == "bool") {
+
+        NodeIndex parseFunction(TokenVectorSize& offset, bool skip_body = false) {
+            /*  Parses function starting with its name at offset and declares its signature.
+             *  Errors in the head of the function are thrown right away, as nothing precedes them.
+             *  If asked to, the body is skipped by matching braces instead of being parsed, and the
+             *  function is left without one.
+             *  Afterwards offset is the index of the closing "}" of the body (the token after ";" if
+             *  the function is only declared).
+             */
+            TokenVectorSize number_of_processed_tokens = 0;
+
+            FunctionSignature signature(tokens[offset + (number_of_processed_tokens++)], no_type, cenv.types);
+            NodeIndex function = tree.add(NodeKind::Function, offset, no_node, no_token);
+            NodeIndex last = no_node;
+
+            if ((offset+number_of_processed_tokens+2) >= tokens.size() or tokens[offset+number_of_processed_tokens].kind() != TokenKind::LeftParen) {
+                throw InvalidSyntax((offset+number_of_processed_tokens), ("missing parameter list in definition of function " + signature.header()));
+            }
+
+            // skip opening "("
+            ++number_of_processed_tokens;
+
+            TokenVectorSize i = offset+number_of_processed_tokens;
+            string param_name, param_type;
+            for (; i < tokens.size() and tokens[i].kind() != TokenKind::RightParen; ++i) {
+                param_type = tokens[i++];
+
+                if (not isRegisteredClass(param_type)) {
+                    throw InvalidSyntax(i-1, ("invalid parameter type in function " + signature.header() + ": " + param_type));
+                }
+
+                param_name = tokens[i];
+                if (not support::str::isname(param_name)) {
+                    throw InvalidSyntax(i, ("invalid parameter name in function " + signature.header() + ": " + param_name));
+                }
+
+                NodeIndex parameter = tree.add(NodeKind::Parameter, (i - 1), static_cast<uint32_t>(i), no_token);
+                last = tree.append(function, last, parameter);
+                signature.parameters.push_back(param_name);
+                signature.parameter_types[param_name] = cenv.types.find(param_type);
+                switch (tokens[i+1].kind()) {
+                    case TokenKind::Comma:
+                        ++i;
+                        break;
+                    case TokenKind::RightParen:
+                        // explicitly do nothing
+                        break;
+                    case TokenKind::Ellipsis:
+                        tree.rhs(parameter, static_cast<uint32_t>(++i));
+                        break;
+                    default:
+                        throw InvalidSyntax(i+1, ("unexpected token in parameters list of function " + signature.function_name + ": " + tokens[i+1].text()));
+                }
+                number_of_processed_tokens += 3;
+            }
+            tree.end(function, i);
+
+            // this if is in case the function has no parameters and
+            // must be here because the for above wasn't entered
+            if (tokens[offset+number_of_processed_tokens].kind() == TokenKind::RightParen) {
+                ++number_of_processed_tokens;
+            }
+
+            if ((offset+number_of_processed_tokens+2) >= tokens.size() and tokens[offset+number_of_processed_tokens].kind() != TokenKind::LeftBrace) {
+                throw InvalidSyntax((offset+number_of_processed_tokens), ("unexpected end of token stream in definition of function " + signature.function_name));
+            }
+            TokenKind after_parameters = tokens[offset+number_of_processed_tokens].kind();
+            if ((after_parameters != TokenKind::Minus or tokens[offset+number_of_processed_tokens+1].kind() != TokenKind::Greater) and after_parameters != TokenKind::LeftBrace and after_parameters != TokenKind::Semicolon) {
+                throw InvalidSyntax(
+                        (offset+number_of_processed_tokens),
+                        ("missing return type specifier in definition of function " + signature.function_name +
+                         ", expected '->' but got: '" +
+                         support::str::strencode(tokens[offset+number_of_processed_tokens]) +
+                         support::str::strencode(tokens[offset+number_of_processed_tokens+1]) +
+                         "'\ntwo previous tokens: " +
+                         support::str::strencode(tokens[offset+number_of_processed_tokens-2]) +
+                         support::str::strencode(tokens[offset+number_of_processed_tokens-1]) +
+                         ""
+                         ));
+            }
+
+            if (after_parameters == TokenKind::Minus) {
+                // skip over "-" and ">" that make up return type specifier
+                number_of_processed_tokens += 2;
+                tree.rhs(function, static_cast<uint32_t>(offset + number_of_processed_tokens));
+                string return_type = tokens[offset + (number_of_processed_tokens++)];
+                if (not isRegisteredClass(return_type)) {
+                    throw InvalidSyntax((offset+number_of_processed_tokens), ("invalid return type in definition of function " + signature.function_name));
+                }
+                signature.return_type = cenv.types.find(return_type);
+            } else {
+                signature.return_type = TypeTable::void_type;
+            }
+
+            vector<TypeID> parameter_types;
+            parameter_types.reserve(signature.parameters.size() + 1);
+            for (const auto& each : signature.parameters) {
+                parameter_types.push_back(signature.parameter_types.at(each));
+            }
+            signature.function_type = cenv.types.function(move(parameter_types), signature.return_type);
+            declared = &cenv.signatures.declare(signature);
+
+            if (tokens[offset+number_of_processed_tokens].kind() == TokenKind::Semicolon) {
+                offset += ++number_of_processed_tokens;
+                return function;
+            }
+
+            if (tokens[offset+number_of_processed_tokens].kind() != TokenKind::LeftBrace) {
+                throw InvalidSyntax((offset+number_of_processed_tokens), ("missing opening '{' in definition of function " + declared->header()));
+            }
+
+            // skip opening "{"
+            offset += ++number_of_processed_tokens;
+
+            if (skip_body) {
+                for (TokenVectorSize depth = 1; offset < tokens.size(); ++offset) {
+                    if (tokens[offset].kind() == TokenKind::LeftBrace) {
+                        ++depth;
+                    } else if (tokens[offset].kind() == TokenKind::RightBrace and --depth == 0) {
+                        break;
+                    }
+                }
+                return function;
+            }
+            tree.append(function, last, parseBody(offset));
+            return function;
+        }
+
+        Parser(const TokenVector& t, CompilationEnvironment& c, SyntaxTree& s): tokens(t), cenv(c), tree(s), declared(nullptr), failed(false) {}
+};
+
+void processVariable(const SyntaxTree& tree, NodeIndex variable, Scope* scope, Code& code) {
+    const TokenVector& tokens = tree.tokens();
+    TokenVectorSize offset = tree.token(variable);
+    TokenVectorSize i = tree.end(variable);
+    string var_name = tokens[tree.lhs(variable)], var_value = "";
+    TypeID var_type = no_type;
+    unsigned var_register = 0;
+
+    // any spelling is accepted here, types that cannot hold a value are rejected below
+    var_type = scope->types().named(tokens[offset]);
+    Symbol var_symbol = tokens[tree.lhs(variable)].symbol();
+
+    // never store in register 0, if the value is not for return
+    var_register = scope->size()+1;
+
+    code.name(var_register, var_name);
+
+    if (tree.rhs(variable) == no_token) {
+        if (var_type == TypeTable::int_type) {
+            var_value = "0";
+        } else if (var_type == TypeTable::string_type) {
+            var_value = "''";
+        } else if (var_type == TypeTable::float_type) {
+            var_value = "0.0";
+        } else if (var_type == TypeTable::bool_type) {
+            var_value = "false";
+        } else if (var_type == TypeTable::auto_type) {
+            throw InvalidSyntax(i, ("unable to determine type of variable " + var_name + " in definition of function " +
+                        scope->function->header() + "; 'auto' cannot be used without initialisation"));
+        } else {
+            throw InvalidSyntax(i, ("invalid type of variable " + var_name + " in definition of function " +
+                        scope->function->header() + ": " + scope->types().name(var_type)));
+        }
+    } else {
+        var_value = tokens[tree.rhs(variable)];
+    }
+    const Variable* source = scope->find(var_value);
+    const FunctionSignature* function = nullptr;
+    if (source != nullptr and source->type == var_type) {
+        code.copy(var_register, source->register_index);
+    } else if (source != nullptr and var_type == TypeTable::auto_type) {
+        var_type = source->type;
+        code.copy(var_register, source->register_index);
+    } else if (var_type == TypeTable::auto_type and (function = scope->findFunction(var_value)) != nullptr) {
+        var_type = function->function_type;
+        code.function(var_register, var_value);
+    } else if (source != nullptr) {
+        throw InvalidSyntax(i, ("cannot convert from " + scope->types().name(source->type) + " to " + scope->types().name(var_type) +
+                    " in initialisation"));
+    } else {
+        if (var_type == TypeTable::auto_type) {
+            if ((var_type = inferType(var_value)) == no_type) {
+                throw InvalidSyntax(offset, ("failed to determine type of auto variable " +
+                            var_name + " in function " + scope->function->header() + ": " + var_value));
+            }
+        }
+        if (var_type == TypeTable::int_type) {
+            code.store(Opcode::Istore, var_register, var_value);
+        } else if (var_type == TypeTable::string_type) {
+            code.store(Opcode::Strstore, var_register, var_value);
+        } else if (var_type == TypeTable::float_type) {
+            code.store(Opcode::Fstore, var_register, var_value);
+        } else if (var_type == TypeTable::bool_type) {
             if (var_value == "false" or var_value == "0") {
-                output << "not (not (istore " << var_register << " 0))" << endl;
+                code.boolean(var_register, false);
             } else if (var_value == "true" or var_value == "1") {
-                output << "not (istore " << var_register << " 0)" << endl;
+                code.boolean(var_register, true);
             } else {
                 throw InvalidSyntax(offset, ("invalid boolean literal in initialisation of variable " +
                             var_name + " in function " + scope->function->header() + ": " + var_value));
             }
         } else {
-            output << ' ' << var_register << ' ' << var_value << endl;
+            throw InvalidSyntax(offset, ("invalid type of variable " +
+                        var_name + " in function " + scope->function->header() + ": " + var_value));
         }
     }
 
-    scope->setregisterof(var_name, var_register);
-    scope->settypeof(var_name, var_type);
-    scope->setvalueof(var_name, var_value);
-
-    return (i-offset);
+    scope->define(var_symbol, var_register, var_type, var_value);
 }
 
-TokenVectorSize processCallWithReturnValueUsedWithSpecifiedReturnRegister(const string& return_to, const TokenVector& tokens, TokenVectorSize offset, Scope* scope, ostringstream& output);
+void processCallWithReturnValueUsedWithSpecifiedReturnRegister(const string& return_to, const SyntaxTree& tree, NodeIndex call, Scope* scope, Code& code);
 
-TokenVectorSize processFrameNested(const TokenVector& tokens, string& function_to_call, TokenVectorSize offset, Scope* scope, ostringstream& output) {
-    TokenVectorSize i = offset;
-    vector<unsigned> parameter_sources;
+TokenVectorSize argumentsOf(const SyntaxTree& tree, NodeIndex call) {
+    /*  Returns index of the first token inside parentheses of the call.
+     *  Diagnostics about the call as a whole point there.
+     */
+    return (tree.lhs(call) == no_node ? tree.end(call) : tree.token(tree.lhs(call)));
+}
+
+void processFrame(const SyntaxTree& tree, NodeIndex call, string& function_to_call, Scope* scope, Code& code) {
+    const TokenVector& tokens = tree.tokens();
+    TokenVectorSize offset = argumentsOf(tree, call);
+    pmr::vector<unsigned> parameter_sources(&scope->function->arena);
 
-    if (scope->defined(function_to_call) and support::str::startswith(scope->typeof(function_to_call, i), "function")) {
-        function_to_call = scope->valueof(function_to_call, i);
+    const Variable* callee = scope->find(function_to_call);
+    if (callee != nullptr and scope->types().isFunction(callee->type)) {
+        if (callee->value.empty()) {
+            // parameters of function type carry no value to call through
+            throw InvalidSyntax(offset, ("access to name not present in scope: " + function_to_call));
+        }
+        function_to_call = callee->value;
     }
 
-    if (not scope->isDeclaredFunction(function_to_call)) {
-        throw InvalidSyntax(i, ("call to undefined function " + function_to_call));
+    // resolved once, signatures stay in place for the whole compilation
+    const FunctionSignature* signature = scope->findFunction(function_to_call);
+    if (signature == nullptr) {
+        throw InvalidSyntax(offset, ("call to undefined function " + function_to_call));
     }
 
-    if (tokens[i] == ")") {
-        if (scope->getFunctionSignature(function_to_call).parameters.size() != 0) {
-            throw InvalidSyntax(i, ("missing parameters in call to function " + scope->getFunctionSignature(function_to_call).header()));
+    if (tree.lhs(call) == no_node) {
+        if (signature->parameters.size() != 0) {
+            throw InvalidSyntax(offset, ("missing parameters in call to function " + signature->header()));
         }
-        output << "    frame 0" << endl;
-        return 2; // number of processed tokens is 2: "(" and ";"
+        code.frame(0);
+        return;
     }
 
     string parameter_name;
-    for (; i < tokens.size() and (not (tokens[i] == ")" or tokens[i] == ",")); ++i) {
-        parameter_name = tokens[i];
-        if (parameter_name == ")") {
-            throw InvalidSyntax(i, ("unexpected end of parameter list in call to function `" + function_to_call + "`"));
+    for (NodeIndex argument = tree.lhs(call); argument != no_node; argument = tree.next(argument)) {
+        TokenVectorSize i = tree.token(argument);
+        if (tree.kind(argument) == NodeKind::Error) {
+            throw InvalidSyntax(i, tree.message(argument));
         }
+
+        parameter_name = tokens[i];
         if (not support::str::isname(parameter_name)) {
-            string var_type = inferType(parameter_name);
+            TypeID var_type = inferType(parameter_name);
             string var_value = parameter_name;
-            int var_register = scope->size()+1;
+            unsigned var_register = scope->size()+1;
             parameter_name = ("_temporary_variable_" + support::str::stringify(var_register));
-            scope->setregisterof(parameter_name, var_register);
-            scope->settypeof(parameter_name, var_type);
-            scope->setvalueof(parameter_name, var_value);
-            output << "    ";
-            if (var_type == "int") {
-                output << "istore";
-            } else if (var_type == "string") {
-                output << "strstore";
-            } else if (var_type == "float") {
-                output << "fstore";
-            }
-            if (var_type == "bool") {
-                if (var_value == "false" or var_value == "0") {
-                    output << "not (not (istore " << var_register << " 0))" << endl;
-                } else if (var_value == "true" or var_value == "1") {
-                    output << "not (istore " << var_register << " 0)" << endl;
-                }
+            scope->define(parameter_name, var_register, var_type, var_value);
+            if (var_type == TypeTable::int_type) {
+                code.store(Opcode::Istore, var_register, var_value);
+            } else if (var_type == TypeTable::string_type) {
+                code.store(Opcode::Strstore, var_register, var_value);
+            } else if (var_type == TypeTable::float_type) {
+                code.store(Opcode::Fstore, var_register, var_value);
+            } else if (var_type == TypeTable::bool_type) {
+                code.boolean(var_register, (var_value == "true" or var_value == "1"));
             } else {
-                output << ' ' << var_register << ' ' << var_value << endl;
-            }
-            if (var_type.size() == 0) {
                 throw InvalidSyntax(i, ("invalid literal used as a parameter in call to function `" + function_to_call + "`"));
             }
         }
-        if (not (scope->defined(parameter_name) or scope->isDeclaredFunction(parameter_name))) {
+        const FunctionSignature* parameter_function = scope->findFunction(parameter_name);
+        if (not (scope->defined(parameter_name) or parameter_function != nullptr)) {
             ostringstream oss;
             oss << "undefined name as parameter: `" << parameter_name << "` in call to function `";
             oss << function_to_call << "`" << "\n";
             oss << "note: parameters in scope:\n";
             vector<string> names = scope->names();
             for (unsigned ps = 0; ps < names.size(); ++ps) {
-                oss << "    " << scope->typeof(names[ps], i) << ' ' << names[ps] << ';' << endl;
+                oss << "    " << scope->types().name(scope->typeof(names[ps], i)) << ' ' << names[ps] << ';' << endl;
             }
             throw InvalidSyntax(i, oss.str());
         }
 
-        auto signature = scope->getFunctionSignature(function_to_call);
-        if (parameter_sources.size() >= signature.parameters.size()) {
-            throw InvalidSyntax(i, ("too many parameters in call to function " + function_to_call + signature.type()));
+        if (parameter_sources.size() >= signature->parameters.size()) {
+            throw InvalidSyntax(i, ("too many parameters in call to function " + function_to_call + signature->type()));
         }
 
-        string p_name = scope->getFunctionSignature(function_to_call).parameters[parameter_sources.size()];
-        string p_type = scope->getFunctionSignature(function_to_call).parameter_types.at(p_name);
+        const string& p_name = signature->parameters[parameter_sources.size()];
+        TypeID p_type = signature->parameter_types.at(p_name);
 
-        if (scope->isDeclaredFunction(parameter_name) and tokens[i+1] == "(") {
+        if (parameter_function != nullptr and tree.lhs(argument) != no_node) {
             // assume it's a call and hope for the best
             auto tmp_param_register = (scope->size()+1);
             string tmp_param_name = ("_tmp_variable_param_" + support::str::stringify(tmp_param_register));
-            scope->setregisterof(tmp_param_name, tmp_param_register);
-            scope->settypeof(tmp_param_name, scope->getFunctionSignature(parameter_name).return_type);
-            scope->setvalueof(tmp_param_name, parameter_name);
-            i += processCallWithReturnValueUsedWithSpecifiedReturnRegister(tmp_param_name, tokens, i, scope, output);
+            scope->define(tmp_param_name, tmp_param_register, parameter_function->return_type, parameter_name);
+            processCallWithReturnValueUsedWithSpecifiedReturnRegister(tmp_param_name, tree, tree.lhs(argument), scope, code);
             parameter_name = tmp_param_name;
+            parameter_function = nullptr;
         }
 
-        if (scope->isDeclaredFunction(parameter_name)) {
+        if (parameter_function != nullptr) {
             auto tmp_param_register = (scope->size()+1);
             string tmp_param_name = ("_tmp_variable_param_" + support::str::stringify(tmp_param_register));
-            output << "    function " << tmp_param_register << ' ' << parameter_name << endl;
-            scope->setregisterof(tmp_param_name, tmp_param_register);
-            scope->settypeof(tmp_param_name, scope->getFunctionSignature(parameter_name).typeof());
-            scope->setvalueof(tmp_param_name, parameter_name);
+            code.function(tmp_param_register, parameter_name);
+            scope->define(tmp_param_name, tmp_param_register, parameter_function->function_type, parameter_name);
             parameter_name = tmp_param_name;
         }
 
-        if (p_type != "auto" and p_type != scope->typeof(parameter_name, i)) {
-            throw InvalidSyntax(i, ("invalid type for parameter " + p_name + " expected " + p_type + " but got " + scope->typeof(parameter_name, i)));
+        const Variable& parameter = scope->lookup(parameter_name, i);
+        if (p_type != TypeTable::auto_type and p_type != parameter.type) {
+            throw InvalidSyntax(i, ("invalid type for parameter " + p_name + " expected " + scope->types().name(p_type) + " but got " + scope->types().name(parameter.type)));
         }
-        parameter_sources.push_back(scope->registerof(parameter_name, i));
-
-        // account for both "," between parameters and
-        // closing ")"
-        ++i;
+        parameter_sources.push_back(parameter.register_index);
     }
 
-    if (scope->getFunctionSignature(function_to_call).parameters.size() != parameter_sources.size()) {
-        throw InvalidSyntax(i, ("missing parameters in call to function " + scope->getFunctionSignature(function_to_call).header()));
+    if (signature->parameters.size() != parameter_sources.size()) {
+        throw InvalidSyntax(tree.end(call), ("missing parameters in call to function " + signature->header()));
     }
 
-    output << "    frame ^[";
+    code.frame(static_cast<unsigned>(parameter_sources.size()));
     for (unsigned j = 0; j < parameter_sources.size(); ++j) {
-        output << "(param " << j << ' ' << parameter_sources[j] << ')';
-        if (j < (parameter_sources.size()-1)) {
-            output << ' ';
+        code.param(j, parameter_sources[j]);
+    }
+}
+
+void processCall(const SyntaxTree& tree, NodeIndex call, Scope* scope, Code& code) {
+    string function_to_call = tree.tokens()[tree.token(call)];
+    processFrame(tree, call, function_to_call, scope, code);
+    code.call(0, function_to_call);
+}
+void processCallWithReturnValueUsedWithSpecifiedReturnRegister(const string& return_to, const SyntaxTree& tree, NodeIndex call, Scope* scope, Code& code) {
+    string function_to_call = tree.tokens()[tree.token(call)];
+
+    // FIXME: functions with "auto" parameters should be considered templates and
+    // have special routines for checking "actual" return type
+    // for now, let's assume the programmer knows what he's doing
+    // only exact names are accepted here, calls to undeclared functions throw std::out_of_range
+    const FunctionSignature& callee = scope->function->env->signatures.at(function_to_call);
+    TypeID function_return_type = callee.return_type;
+    // copied, the frame may define temporaries and move the variables of the scope around
+    const Variable target = scope->lookup(return_to, tree.token(call));
+    if (target.type != function_return_type and function_return_type != TypeTable::auto_type) {
+        throw InvalidSyntax(argumentsOf(tree, call), (
+                    "mismatched type of return target variable " + return_to + " of type " + scope->types().name(target.type) + " and return type of function " + callee.header()));
+    }
+
+    processFrame(tree, call, function_to_call, scope, code);
+    code.call(target.register_index, function_to_call);
+}
+void processCallWithReturnValueUsed(const SyntaxTree& tree, NodeIndex assignment, Scope* scope, Code& code) {
+    const TokenVector& tokens = tree.tokens();
+    TokenVectorSize i = tree.token(assignment);
+    if (not scope->defined(tokens[i].symbol())) {
+        throw InvalidSyntax(i, ("unexpected token: " + support::str::strencode(tokens[i])));
+    }
+    string return_to = tokens[i];
+    NodeIndex call = tree.lhs(assignment);
+    string function_to_call = tokens[tree.token(call)];
+
+    // FIXME: functions with "auto" parameters should be considered templates and
+    // have special routines for checking "actual" return type
+    // for now, let's assume the programmer knows what he's doing
+    // only exact names are accepted here, calls to undeclared functions throw std::out_of_range
+    const FunctionSignature& callee = scope->function->env->signatures.at(function_to_call);
+    TypeID function_return_type = callee.return_type;
+    // copied, the frame may define temporaries and move the variables of the scope around
+    const Variable target = scope->lookup(return_to, i);
+    if (target.type != function_return_type and function_return_type != TypeTable::auto_type) {
+        throw InvalidSyntax(argumentsOf(tree, call), (
+                    "mismatched type of return target variable " + return_to + " of type " + scope->types().name(target.type) + " and return type of function " + callee.header()));
+    }
+
+    processFrame(tree, call, function_to_call, scope, code);
+    code.call(target.register_index, function_to_call);
+}
+
+class BlockStack {
+    /*  Blocks whose statements are being compiled, innermost last.
+     *
+     *  Nested blocks are kept here instead of on the native stack so that depth of nesting
+     *  is limited only by available memory.
+     *  Scopes of nested blocks are owned by the stack; the outermost block of a function uses
+     *  the scope it was given.
+     */
+    public:
+        enum class Kind {
+            Body,
+            Bare,
+            If,
+            While,
+        };
+
+        struct Block {
+            Kind kind;
+            // next statement to compile
+            NodeIndex at;
+            Scope* scope;
+
+            // labels of if- and while-statements
+            string_view begin_label;
+            string_view end_label;
+            // loop labels that were in effect before the while-statement was entered
+            string_view enclosing_loop_begin;
+            string_view enclosing_loop_end;
+        };
+
+    private:
+        pmr::vector<Block> blocks;
+        // deque, because scopes of nested blocks point to scopes of their parents
+        pmr::deque<Scope> scopes;
+
+    public:
+        Block& top() {
+            return blocks.back();
         }
+
+        Block& open(Kind kind, NodeIndex at, Scope* parent) {
+            /*  Opens a block whose first statement is at.
+             *  Returned reference is valid until the next block is opened.
+             */
+            Scope* scope = parent;
+            if (kind != Kind::Body) {
+                scopes.emplace_back(parent->function, parent);
+                scope = &scopes.back();
+            }
+            blocks.push_back(Block{kind, at, scope, {}, {}, {}, {}});
+            return blocks.back();
+        }
+
+        void close() {
+            if (blocks.back().kind != Kind::Body) {
+                scopes.pop_back();
+            }
+            blocks.pop_back();
+        }
+
+        BlockStack(pmr::memory_resource* memory): blocks(memory), scopes(memory) {}
+};
+
+void processIfStatement(const SyntaxTree& tree, NodeIndex statement, Scope* scope, Code& code, BlockStack& blocks) {
+    /*  Compiles head of an if-statement and opens its block.
+     */
+    const TokenVector& tokens = tree.tokens();
+    TokenVectorSize i = tree.token(statement);
+
+    if (not scope->defined(tokens[i].symbol())) {
+        throw InvalidSyntax(i, ("undeclared variable in condition experssion: " + support::str::strencode(tokens[i].text())));
+    }
+
+    Symbol if_test_variable = tokens[i].symbol();
+    string_view false_branch_name = scope->function->label("_if_", scope->function->ifs++);
+
+    NodeIndex block = tree.lhs(statement);
+    if (tree.kind(block) == NodeKind::Error) {
+        throw InvalidSyntax(tree.token(block), tree.message(block));
     }
-    output << "]" << endl;
 
-    // skip terminating ";"
-    ++i;
+    code.branch(scope->registerof(if_test_variable, i), false_branch_name);
 
-    return (i-offset);
+    // the false branch is marked when the block is closed
+    blocks.open(BlockStack::Kind::If, tree.lhs(block), scope).end_label = false_branch_name;
 }
 
-TokenVectorSize processFrame(const TokenVector& tokens, string& function_to_call, TokenVectorSize offset, Scope* scope, ostringstream& output) {
-    TokenVectorSize i = offset;
-    vector<unsigned> parameter_sources;
+void processWhileStatement(const SyntaxTree& tree, NodeIndex statement, Scope* scope, Code& code, BlockStack& blocks) {
+    /*  Compiles head of a while-statement and opens its block.
+     */
+    const TokenVector& tokens = tree.tokens();
+    TokenVectorSize i = tree.token(statement);
 
-    if (scope->defined(function_to_call) and support::str::startswith(scope->typeof(function_to_call, i), "function")) {
-        function_to_call = scope->valueof(function_to_call, i);
+    if (not scope->defined(tokens[i].symbol())) {
+        throw InvalidSyntax(i, ("undeclared variable in condition experssion: " + tokens[i].text()));
     }
 
-    if (not scope->isDeclaredFunction(function_to_call)) {
-        throw InvalidSyntax(i, ("call to undefined function " + function_to_call));
+    Symbol if_test_variable = tokens[i].symbol();
+    string_view loop_name_begin = scope->function->label("_begin_while_", scope->function->whiles++);
+    string_view loop_name_end = scope->function->label("_end_while_", scope->function->whiles);
+
+    NodeIndex block = tree.lhs(statement);
+    if (tree.kind(block) == NodeKind::Error) {
+        throw InvalidSyntax(tree.token(block), tree.message(block));
+    }
+
+    code.mark(loop_name_begin);
+    code.branch(scope->registerof(if_test_variable, i), loop_name_end);
+
+    // the loop is closed, and enclosing loop labels restored, when the block is closed
+    BlockStack::Block& opened = blocks.open(BlockStack::Kind::While, tree.lhs(block), scope);
+    opened.begin_label = loop_name_begin;
+    opened.end_label = loop_name_end;
+    opened.enclosing_loop_begin = scope->function->loop_begin;
+    opened.enclosing_loop_end = scope->function->loop_end;
+    scope->function->loop_begin = loop_name_begin;
+    scope->function->loop_end = loop_name_end;
+}
+
+TokenVectorSize processClass(const TokenVector& tokens, TokenVectorSize offset, CompilationEnvironment& cenv, ostringstream& output, const string& namespace_prefix = "") {
+    TokenVectorSize number_of_processed_tokens = 0;
+
+    string name = tokens[offset + (number_of_processed_tokens++)];
+    if (namespace_prefix.size()) {
+        name = (namespace_prefix + "::" + name);
     }
 
-    if (tokens[i] == ")") {
-        if (scope->getFunctionSignature(function_to_call).parameters.size() != 0) {
-            throw InvalidSyntax(i, ("missing parameters in call to function " + scope->getFunctionSignature(function_to_call).header()));
+    Class klass(name);
+
+    cenv.classes[name] = klass;
+
+    return number_of_processed_tokens;
+}
+
+class RegisterAllocator {
+    /*  Renumbers registers of a compiled function so that registers are reused as soon as their values die.
+     *
+     *  Every instruction of the function is a node of the control flow graph.
+     *  Liveness of each register is found by walking backwards from its uses until a definition is met,
+     *  and the instructions it is live on make up its live interval.
+     *  Intervals are then assigned registers with a linear scan, always picking the lowest free register.
+     *
+     *  All memory used by the allocator comes from the memory resource it is given.
+     *
+     *  Register 0 holds return values and is left alone.
+     *  Bodies containing inline assembly (which may refer to registers by name), or jumps to labels that are
+     *  not marked in the body, are left untouched.
+     */
+    using size_type = Code::size_type;
+    static constexpr size_type nowhere = numeric_limits<size_type>::max();
+
+    enum class Access {
+        Use,
+        Def,
+        Name,
+    };
+    struct Operand {
+        size_type line;
+        unsigned Instruction::* field;
+        unsigned index;
+        Access access;
+    };
+    struct Jump {
+        size_type line;
+        string_view target;
+    };
+
+    Code& code;
+    pmr::memory_resource* memory;
+    pmr::vector<bool> falls_through;
+    pmr::vector<Operand> operands;
+    pmr::vector<Jump> jumps;
+    pmr::unordered_map<string_view, size_type> marks;
+    bool understood;
+
+    void operand(size_type line, unsigned Instruction::* field, Access access) {
+        unsigned index = (code[line].*field);
+        if (index != 0) {
+            operands.push_back(Operand { line, field, index, access });
+            registers_before = max(registers_before, (index + 1));
         }
-        output << "    frame 0" << endl;
-        return 2; // number of processed tokens is 2: "(" and ";"
     }
 
-    string parameter_name;
-    for (; i < tokens.size() and tokens[i] != ";"; ++i) {
-        parameter_name = tokens[i];
-        if (parameter_name == ")") {
-            throw InvalidSyntax(i, ("unexpected end of parameter list in call to function `" + function_to_call + "`"));
+    bool parse(size_type line) {
+        /*  Records operands of an instruction.
+         *  Returns false if the instruction is not understood.
+         */
+        const Instruction& each = code[line];
+        switch (each.opcode) {
+            case Opcode::Mark:
+                marks[each.text] = line;
+                return true;
+            case Opcode::Comment:
+            case Opcode::Frame:
+            case Opcode::Inlined:
+                return true;
+            case Opcode::Name:
+                operand(line, &Instruction::target, Access::Name);
+                return true;
+            case Opcode::Arg:
+            case Opcode::Izero:
+            case Opcode::Istore:
+            case Opcode::Fstore:
+            case Opcode::Strstore:
+            case Opcode::Function:
+            case Opcode::Call:
+                operand(line, &Instruction::target, Access::Def);
+                return true;
+            case Opcode::Not:
+            case Opcode::Copy:
+            case Opcode::Move:
+            case Opcode::Operand:
+                operand(line, &Instruction::target, Access::Def);
+                operand(line, &Instruction::source, Access::Use);
+                return true;
+            case Opcode::Param:
+                operand(line, &Instruction::source, Access::Use);
+                return true;
+            case Opcode::Branch:
+                jumps.push_back(Jump { line, each.text });
+                operand(line, &Instruction::source, Access::Use);
+                return true;
+            case Opcode::Jump:
+                jumps.push_back(Jump { line, each.text });
+                falls_through.back() = false;
+                return true;
+            case Opcode::Return:
+            case Opcode::Tailcall:
+                falls_through.back() = false;
+                return true;
+            case Opcode::Asm:
+                return false;
         }
-        if (not support::str::isname(parameter_name)) {
-            string var_type = inferType(parameter_name);
-            string var_value = parameter_name;
-            int var_register = scope->size()+1;
-            parameter_name = ("_temporary_variable_" + support::str::stringify(var_register));
-            scope->setregisterof(parameter_name, var_register);
-            scope->settypeof(parameter_name, var_type);
-            scope->setvalueof(parameter_name, var_value);
-            output << "    ";
-            if (var_type == "int") {
-                output << "istore";
-            } else if (var_type == "string") {
-                output << "strstore";
-            } else if (var_type == "float") {
-                output << "fstore";
-            }
-            if (var_type == "bool") {
-                if (var_value == "false" or var_value == "0") {
-                    output << "not (not (istore " << var_register << " 0))" << endl;
-                } else if (var_value == "true" or var_value == "1") {
-                    output << "not (istore " << var_register << " 0)" << endl;
+        return false;
+    }
+
+    public:
+        unsigned registers_before;
+        unsigned registers_after;
+
+        void allocate() {
+            /*  Renumbers registers of the code in place.
+             */
+            if (not understood) {
+                registers_after = registers_before;
+                return;
+            }
+
+            // predecessors of line i are predecessors[predecessors_begin[i] .. predecessors_begin[i+1])
+            pmr::vector<size_type> predecessors_begin(code.size() + 1, 0, memory);
+            auto edges = [this](auto&& edge) {
+                for (size_type i = 0; (i + 1) < code.size(); ++i) {
+                    if (falls_through[i]) {
+                        edge(i, (i + 1));
+                    }
                 }
-            } else {
-                output << ' ' << var_register << ' ' << var_value << endl;
+                for (const auto& each : jumps) {
+                    edge(each.line, marks.at(each.target));
+                }
+            };
+            edges([&predecessors_begin](size_type, size_type to) {
+                ++predecessors_begin[to + 1];
+            });
+            for (size_type i = 0; i < code.size(); ++i) {
+                predecessors_begin[i + 1] += predecessors_begin[i];
             }
-            if (var_type.size() == 0) {
-                throw InvalidSyntax(i, ("invalid literal used as a parameter in call to function `" + function_to_call + "`"));
+            pmr::vector<size_type> predecessors(predecessors_begin.back(), memory);
+            pmr::vector<size_type> filled(predecessors_begin.begin(), (predecessors_begin.end() - 1), memory);
+            edges([&predecessors, &filled](size_type from, size_type to) {
+                predecessors[filled[to]++] = from;
+            });
+
+            // live intervals, indexed by original register
+            pmr::vector<pair<size_type, size_type>> intervals(registers_before, { nowhere, 0 }, memory);
+            auto extend = [&intervals](unsigned r, size_type i) {
+                auto& interval = intervals[r];
+                interval.first = (interval.first == nowhere ? i : min(interval.first, i));
+                interval.second = max(interval.second, i);
+            };
+
+            // operands are recorded line by line, so operands of line i are a contiguous run
+            pmr::vector<size_type> operands_begin(code.size() + 1, 0, memory);
+            for (const auto& each : operands) {
+                ++operands_begin[each.line + 1];
+                extend(each.index, each.line);
             }
-        }
-        if (not (scope->defined(parameter_name) or scope->isDeclaredFunction(parameter_name))) {
-            ostringstream oss;
-            oss << "undefined name as parameter: `" << parameter_name << "` in call to function `";
-            oss << function_to_call << "`" << "\n";
-            oss << "note: parameters in scope:\n";
-            vector<string> names = scope->names();
-            for (unsigned ps = 0; ps < names.size(); ++ps) {
-                oss << "    " << scope->typeof(names[ps], i) << ' ' << names[ps] << ';' << endl;
+            for (size_type i = 0; i < code.size(); ++i) {
+                operands_begin[i + 1] += operands_begin[i];
             }
-            throw InvalidSyntax(i, oss.str());
-        }
+            auto defines = [this, &operands_begin](size_type i, unsigned r) {
+                for (auto k = operands_begin[i]; k < operands_begin[i + 1]; ++k) {
+                    if (operands[k].index == r and operands[k].access == Access::Def) {
+                        return true;
+                    }
+                }
+                return false;
+            };
 
-        auto signature = scope->getFunctionSignature(function_to_call);
-        if (parameter_sources.size() >= signature.parameters.size()) {
-            throw InvalidSyntax(i, ("too many parameters in call to function " + function_to_call + signature.type()));
-        }
+            pmr::vector<const Operand*> uses(memory);
+            for (const auto& each : operands) {
+                if (each.access == Access::Use) {
+                    uses.push_back(&each);
+                }
+            }
+            // ties are broken by position so that the order does not depend on the sort
+            sort(uses.begin(), uses.end(), [](const Operand* a, const Operand* b) {
+                return (a->index < b->index or (a->index == b->index and a < b));
+            });
+
+            // visited[i] == r means line i is already known to have register r live on entry
+            pmr::vector<unsigned> visited(code.size(), 0, memory);
+            pmr::vector<size_type> work(memory);
+            for (auto use = uses.begin(); use != uses.end();) {
+                unsigned r = (*use)->index;
+                for (; use != uses.end() and (*use)->index == r; ++use) {
+                    if (visited[(*use)->line] != r) {
+                        visited[(*use)->line] = r;
+                        work.push_back((*use)->line);
+                    }
+                }
+                while (not work.empty()) {
+                    size_type live_in = work.back();
+                    work.pop_back();
+                    for (auto k = predecessors_begin[live_in]; k < predecessors_begin[live_in + 1]; ++k) {
+                        size_type p = predecessors[k];
+                        extend(r, p);
+                        if (visited[p] != r and not defines(p, r)) {
+                            visited[p] = r;
+                            work.push_back(p);
+                        }
+                    }
+                }
+            }
 
-        string p_name = scope->getFunctionSignature(function_to_call).parameters[parameter_sources.size()];
-        string p_type = scope->getFunctionSignature(function_to_call).parameter_types.at(p_name);
+            pmr::vector<unsigned> order(memory);
+            for (unsigned r = 1; r < registers_before; ++r) {
+                if (intervals[r].first != nowhere) {
+                    order.push_back(r);
+                }
+            }
+            sort(order.begin(), order.end(), [&intervals](unsigned a, unsigned b) {
+                return (intervals[a].first < intervals[b].first or (intervals[a].first == intervals[b].first and a < b));
+            });
+
+            pmr::vector<unsigned> assigned(registers_before, 0, memory);
+            // active intervals ordered by end, idle registers ordered lowest first
+            using Active = pair<size_type, unsigned>;
+            priority_queue<Active, pmr::vector<Active>, greater<Active>> active(greater<Active>{}, pmr::vector<Active>{memory});
+            priority_queue<unsigned, pmr::vector<unsigned>, greater<unsigned>> idle(greater<unsigned>{}, pmr::vector<unsigned>{memory});
+            registers_after = 1;
+            for (auto r : order) {
+                while (not active.empty() and active.top().first < intervals[r].first) {
+                    idle.push(assigned[active.top().second]);
+                    active.pop();
+                }
+                if (idle.empty()) {
+                    assigned[r] = registers_after++;
+                } else {
+                    assigned[r] = idle.top();
+                    idle.pop();
+                }
+                active.emplace(intervals[r].second, r);
+            }
 
-        if (scope->isDeclaredFunction(parameter_name) and tokens[i+1] == "(") {
-            // assume it's a call and hope for the best
-            auto tmp_param_register = (scope->size()+1);
-            string tmp_param_name = ("_tmp_variable_param_" + support::str::stringify(tmp_param_register));
-            scope->setregisterof(tmp_param_name, tmp_param_register);
-            scope->settypeof(tmp_param_name, scope->getFunctionSignature(parameter_name).return_type);
-            scope->setvalueof(tmp_param_name, parameter_name);
-            i += processCallWithReturnValueUsedWithSpecifiedReturnRegister(tmp_param_name, tokens, i, scope, output);
-            parameter_name = tmp_param_name;
+            for (const auto& each : operands) {
+                code[each.line].*each.field = assigned[each.index];
+            }
         }
 
-        if (scope->isDeclaredFunction(parameter_name)) {
-            auto tmp_param_register = (scope->size()+1);
-            string tmp_param_name = ("_tmp_variable_param_" + support::str::stringify(tmp_param_register));
-            output << "    function " << tmp_param_register << ' ' << parameter_name << endl;
-            scope->setregisterof(tmp_param_name, tmp_param_register);
-            scope->settypeof(tmp_param_name, scope->getFunctionSignature(parameter_name).typeof());
-            scope->setvalueof(tmp_param_name, parameter_name);
-            parameter_name = tmp_param_name;
+        RegisterAllocator(Code& c, pmr::memory_resource* m):
+            code(c),
+            memory(m),
+            falls_through(m),
+            operands(m),
+            jumps(m),
+            marks(m),
+            understood(true),
+            registers_before(1),
+            registers_after(1)
+        {
+            for (size_type i = 0; i < code.size(); ++i) {
+                falls_through.push_back(true);
+                understood = (parse(i) and understood);
+            }
+            for (const auto& each : jumps) {
+                understood = (understood and marks.count(each.target));
+            }
         }
+};
 
-        if (p_type != "auto" and p_type != scope->typeof(parameter_name, i)) {
-            throw InvalidSyntax(i, ("invalid type for parameter " + p_name + " expected " + p_type + " but got " + scope->typeof(parameter_name, i)));
+class Peephole {
+    /*  Rewrites short sequences of instructions of a compiled function into shorter ones.
+     *
+     *  Rewrites are listed in the pattern table below; each pattern looks at the instruction it is
+     *  applied to and the few following it (or the first one at the label it jumps to), and either
+     *  rewrites them in place or flags them as removed.
+     *  Patterns are applied until none of them matches, so that rewrites can enable each other.
+     *  All memory used comes from the memory resource the pass is given.
+     */
+    using size_type = Code::size_type;
+    static constexpr size_type nowhere = numeric_limits<size_type>::max();
+    static const unsigned max_rounds = 8;
+
+    struct Pattern {
+        const char* name;
+        bool (*apply)(Peephole&, size_type);
+    };
+    static const Pattern patterns[];
+
+    Code& code;
+    pmr::memory_resource* memory;
+    pmr::vector<bool> removed;
+    pmr::unordered_map<string_view, size_type> marks;
+    // registers whose values are only ever tested by branches (and so need not be booleans)
+    pmr::vector<bool> only_tested;
+
+    size_type next(size_type i) const {
+        /*  Returns index of the instruction executed after the one at i (if it does not jump), or nowhere.
+         */
+        for (++i; i < code.size() and (removed[i] or isDirective(code[i].opcode)); ++i) {
         }
-        parameter_sources.push_back(scope->registerof(parameter_name, i));
-
-        // account for both "," between parameters and
-        // closing ")"
-        ++i;
+        return (i < code.size() ? i : nowhere);
     }
-
-    if (scope->getFunctionSignature(function_to_call).parameters.size() != parameter_sources.size()) {
-        throw InvalidSyntax(i, ("missing parameters in call to function " + scope->getFunctionSignature(function_to_call).header()));
+    size_type at(string_view label) const {
+        /*  Returns index of the first instruction executed after jumping to the label, or nowhere.
+         */
+        auto found = marks.find(label);
+        return (found == marks.end() ? nowhere : next(found->second));
+    }
+    bool marked(size_type from, size_type to) const {
+        /*  Returns true if there is a mark between the instructions, i.e. something may jump in between them.
+         */
+        for (size_type i = (from + 1); i < to; ++i) {
+            if (not removed[i] and code[i].opcode == Opcode::Mark) {
+                return true;
+            }
+        }
+        return false;
+    }
+    bool tested(unsigned r) const {
+        return (r < only_tested.size() and only_tested[r]);
     }
 
-    output << "    frame ^[";
-    for (unsigned j = 0; j < parameter_sources.size(); ++j) {
-        output << "(param " << j << ' ' << parameter_sources[j] << ')';
-        if (j < (parameter_sources.size()-1)) {
-            output << ' ';
+    unsigned count() const {
+        /*  Returns number of instructions, not counting directives.
+         */
+        unsigned n = 0;
+        for (size_type i = 0; i < code.size(); ++i) {
+            n += (isDirective(code[i].opcode) ? 0 : 1);
         }
+        return n;
     }
-    output << "]" << endl;
 
-    // skip terminating ";"
-    ++i;
+    static bool testedBoolean(Peephole& p, size_type i) {
+        /*  istore r 0; not r; [not r] -> istore r 1 or izero r, if r is only tested by branches.
+         */
+        Instruction& store = p.code[i];
+        if (store.opcode != Opcode::Istore or store.text != "0" or not p.tested(store.target)) {
+            return false;
+        }
+        size_type first = p.next(i);
+        if (first == nowhere or not p.code[first].nested) {
+            return false;
+        }
+        size_type second = p.next(first);
+        p.removed[first] = true;
+        if (second != nowhere and p.code[second].nested) {
+            p.removed[second] = true;
+            store.opcode = Opcode::Izero;
+            store.text = "";
+        } else {
+            store.text = "1";
+        }
+        return true;
+    }
+    static bool definitionMoved(Peephole& p, size_type i) {
+        /*  <def> a ...; move b a -> <def> b ..., as the move leaves a empty anyway.
+         */
+        Instruction& definition = p.code[i];
+        switch (definition.opcode) {
+            case Opcode::Izero:
+            case Opcode::Istore:
+            case Opcode::Fstore:
+            case Opcode::Strstore:
+            case Opcode::Function:
+            case Opcode::Copy:
+            case Opcode::Move:
+            case Opcode::Call:
+                break;
+            default:
+                return false;
+        }
+        size_type following = p.next(i);
+        if (following == nowhere or p.marked(i, following)) {
+            return false;
+        }
+        const Instruction& move = p.code[following];
+        if (move.opcode != Opcode::Move or move.source != definition.target or move.target == definition.target or move.nested or definition.source == definition.target) {
+            return false;
+        }
+        // result of call to register 0 is dropped
+        if (definition.opcode == Opcode::Call and move.target == 0) {
+            return false;
+        }
+        definition.target = move.target;
+        p.removed[following] = true;
+        return true;
+    }
+    static bool selfMove(Peephole& p, size_type i) {
+        /*  copy a a and move a a -> nothing.
+         */
+        const Instruction& each = p.code[i];
+        if ((each.opcode != Opcode::Copy and each.opcode != Opcode::Move) or each.target != each.source) {
+            return false;
+        }
+        p.removed[i] = true;
+        return true;
+    }
+    static bool jumpToJump(Peephole& p, size_type i) {
+        /*  jump L or branch r +1 L, where L: jump M -> jump M or branch r +1 M.
+         */
+        Instruction& each = p.code[i];
+        if (each.opcode != Opcode::Jump and each.opcode != Opcode::Branch) {
+            return false;
+        }
+        size_type target = p.at(each.text);
+        if (target == nowhere or target == i or p.code[target].opcode != Opcode::Jump or p.code[target].text == each.text) {
+            return false;
+        }
+        each.text = p.code[target].text;
+        return true;
+    }
+    static bool jumpToReturn(Peephole& p, size_type i) {
+        /*  jump L, where L: return -> return.
+         */
+        Instruction& each = p.code[i];
+        if (each.opcode != Opcode::Jump) {
+            return false;
+        }
+        size_type target = p.at(each.text);
+        if (target == nowhere or p.code[target].opcode != Opcode::Return) {
+            return false;
+        }
+        each.opcode = Opcode::Return;
+        each.text = "";
+        return true;
+    }
+    static bool jumpToNext(Peephole& p, size_type i) {
+        /*  jump L or branch r +1 L, where L is the next instruction -> nothing.
+         */
+        const Instruction& each = p.code[i];
+        if ((each.opcode != Opcode::Jump and each.opcode != Opcode::Branch) or p.marks.count(each.text) == 0) {
+            return false;
+        }
+        size_type mark = p.marks.at(each.text);
+        if (mark < i) {
+            return false;
+        }
+        for (size_type k = (i + 1); k < mark; ++k) {
+            if (not p.removed[k] and not isDirective(p.code[k].opcode)) {
+                return false;
+            }
+        }
+        p.removed[i] = true;
+        return true;
+    }
+    static bool unreachable(Peephole& p, size_type i) {
+        /*  jump, return or tailcall, followed by instructions before the next mark -> jump, return or tailcall.
+         */
+        const Instruction& each = p.code[i];
+        if (each.opcode != Opcode::Jump and each.opcode != Opcode::Return and each.opcode != Opcode::Tailcall) {
+            return false;
+        }
+        bool matched = false;
+        for (size_type k = (i + 1); k < p.code.size() and p.code[k].opcode != Opcode::Mark; ++k) {
+            if (not p.removed[k] and not isDirective(p.code[k].opcode)) {
+                p.removed[k] = true;
+                matched = true;
+            }
+        }
+        return matched;
+    }
 
-    return (i-offset);
-}
+    public:
+        unsigned instructions_before;
+        unsigned instructions_after;
+
+        void optimise() {
+            only_tested.assign(code.registers(), true);
+            // register 0 is read by return
+            only_tested[0] = false;
+            for (size_type i = 0; i < code.size(); ++i) {
+                const Instruction& each = code[i];
+                if (each.opcode == Opcode::Asm) {
+                    // inline assembly may read any register
+                    only_tested.assign(only_tested.size(), false);
+                    break;
+                }
+                if (each.source != no_register and each.opcode != Opcode::Branch and not each.nested) {
+                    only_tested[each.source] = false;
+                }
+            }
 
-TokenVectorSize processCall(const TokenVector& tokens, TokenVectorSize offset, Scope* scope, ostringstream& output) {
-    string function_to_call = tokens[offset++];
-    // skip opening "("
-    ++offset;
-    TokenVectorSize i = processFrame(tokens, function_to_call, offset, scope, output);
-    output << "    call 0 " << function_to_call << endl;
+            instructions_before = count();
+            // jumps could be threaded forever around a loop made only of jumps, so the number of rounds is limited
+            bool changed = true;
+            for (unsigned round = 0; changed and round < max_rounds; ++round) {
+                changed = false;
+                removed.assign(code.size(), false);
+                marks.clear();
+                for (size_type i = 0; i < code.size(); ++i) {
+                    if (code[i].opcode == Opcode::Mark) {
+                        marks[code[i].text] = i;
+                    }
+                }
+                for (size_type i = 0; i < code.size(); ++i) {
+                    for (const Pattern* pattern = patterns; pattern->apply != nullptr and not removed[i]; ++pattern) {
+                        changed = (pattern->apply(*this, i) or changed);
+                    }
+                }
+                code.erase(removed);
+            }
+            instructions_after = count();
+        }
 
-    return i;
-}
-TokenVectorSize processCallWithReturnValueUsedWithSpecifiedReturnRegister(const string& return_to, const TokenVector& tokens, TokenVectorSize offset, Scope* scope, ostringstream& output) {
-    string function_to_call = tokens[offset++];
+        Peephole(Code& c, pmr::memory_resource* m):
+            code(c),
+            memory(m),
+            removed(m),
+            marks(m),
+            only_tested(m),
+            instructions_before(0),
+            instructions_after(0)
+        {}
+};
 
-    // skip opening "("
-    ++offset;
+const Peephole::Pattern Peephole::patterns[] = {
+    { "boolean only tested by branches", Peephole::testedBoolean },
+    { "definition moved away at once", Peephole::definitionMoved },
+    { "move to the same register", Peephole::selfMove },
+    { "jump to jump", Peephole::jumpToJump },
+    { "jump to return", Peephole::jumpToReturn },
+    { "jump to the next instruction", Peephole::jumpToNext },
+    { "unreachable instructions", Peephole::unreachable },
+    { nullptr, nullptr },
+};
 
-    // FIXME: functions with "auto" parameters should be considered templates and
-    // have special routines for checking "actual" return type
-    // for now, let's assume the programmer knows what he's doing
-    string function_return_type = scope->function->env->functions.at(function_to_call);
-    if (scope->typeof(return_to, offset-4) != function_return_type and function_return_type != "auto") {
-        throw InvalidSyntax(offset, (
-                    "mismatched type of return target variable " + return_to + " of type " + scope->typeof(return_to, offset-4) + " and return type of function " + scope->getFunctionSignature(function_to_call).header()));
+class ConstantPropagation {
+    /*  Propagates constants through the code of a compiled function.
+     *
+     *  Values of registers are followed through the control flow graph of the function, block by
+     *  block until they stop changing; a register holds a constant if every path leading to the
+     *  instruction stores the same literal in it.
+     *  Branches on constants are folded and blocks that can no longer be reached are removed,
+     *  constants copied or moved to another register are stored there directly, and constant
+     *  parameters are passed from the first register holding the same constant.
+     *  Stores whose values are never read afterwards are removed last.
+     *  Functions containing inline assembly are left as they are.
+     */
+    using size_type = Code::size_type;
+    static constexpr size_type nowhere = numeric_limits<size_type>::max();
+    // values of every register are kept for every block, so larger functions are left as they are
+    static const size_type max_values = (1 << 20);
+    static const unsigned max_rounds = 4;
+
+    enum class Known : unsigned char {
+        // the value may differ between paths, or the register is empty
+        Nothing,
+        Integer,
+        Float,
+        String,
+        Boolean,
+    };
+    struct Value {
+        Known known;
+        // meaningful for integers and booleans, which branches can test
+        bool truth;
+        string_view literal;
+
+        bool tested() const {
+            return (known == Known::Integer or known == Known::Boolean);
+        }
+        bool operator==(const Value& that) const {
+            return (known == that.known and truth == that.truth and literal == that.literal);
+        }
+        bool operator!=(const Value& that) const {
+            return not (*this == that);
+        }
+    };
+    using Values = pmr::vector<Value>;
+    static constexpr Value nothing = Value { Known::Nothing, false, "" };
+
+    Code& code;
+    pmr::memory_resource* memory;
+    unsigned registers;
+    pmr::vector<bool> removed;
+
+    // first instruction of each basic block, and the block jumped to from the end of each
+    // block (if it ends with a jump or branch)
+    pmr::vector<size_type> blocks;
+    pmr::vector<size_type> jumps;
+    pmr::unordered_map<string_view, size_type> marks;
+
+    size_type end(size_type b) const {
+        return ((b + 1) < blocks.size() ? blocks[b + 1] : code.size());
+    }
+    bool split() {
+        /*  Splits the code into basic blocks.
+         *  Returns false if some jump has no mark to go to.
+         */
+        blocks.clear();
+        marks.clear();
+        for (size_type i = 0; i < code.size(); ++i) {
+            Opcode opcode = code[i].opcode;
+            if (i == 0 or opcode == Opcode::Mark or code[i - 1].opcode == Opcode::Jump or code[i - 1].opcode == Opcode::Branch or
+                    code[i - 1].opcode == Opcode::Return or code[i - 1].opcode == Opcode::Tailcall) {
+                blocks.push_back(i);
+            }
+            if (opcode == Opcode::Mark) {
+                marks[code[i].text] = (blocks.size() - 1);
+            }
+        }
+        jumps.assign(blocks.size(), nowhere);
+        for (size_type b = 0; b < blocks.size(); ++b) {
+            const Instruction& last = code[end(b) - 1];
+            if (last.opcode == Opcode::Jump or last.opcode == Opcode::Branch) {
+                auto found = marks.find(last.text);
+                if (found == marks.end()) {
+                    return false;
+                }
+                jumps[b] = found->second;
+            }
+        }
+        return true;
     }
 
-    TokenVectorSize i = processFrameNested(tokens, function_to_call, offset, scope, output);
-    output << "    call " << scope->registerof(return_to, (offset-4)) << ' ' << function_to_call << endl;
+    template<typename Visit> void successors(size_type b, const Values* values, Visit visit) const {
+        /*  Visits blocks executed after the block.
+         *  If values at the end of the block are given, branches on constants go only one way.
+         */
+        const Instruction& last = code[end(b) - 1];
+        bool falls = ((b + 1) < blocks.size());
+        if (last.opcode == Opcode::Return or last.opcode == Opcode::Tailcall) {
+            return;
+        }
+        if (last.opcode == Opcode::Jump) {
+            visit(jumps[b]);
+            return;
+        }
+        if (last.opcode == Opcode::Branch) {
+            const Value* condition = (values ? &(*values)[last.source] : nullptr);
+            if (condition == nullptr or not condition->tested() or not condition->truth) {
+                visit(jumps[b]);
+            }
+            falls = (falls and (condition == nullptr or not condition->tested() or condition->truth));
+        }
+        if (falls) {
+            visit(b + 1);
+        }
+    }
 
-    return i;
-}
-TokenVectorSize processCallWithReturnValueUsed(const TokenVector& tokens, TokenVectorSize offset, Scope* scope, ostringstream& output) {
-    string return_to = tokens[offset++];
+    static bool truthy(string_view integer) {
+        return (integer.find_first_of("123456789") != string_view::npos);
+    }
+    static void transfer(const Instruction& each, Values& values) {
+        /*  Updates values of registers after the instruction is executed.
+         */
+        switch (each.opcode) {
+            case Opcode::Izero:
+                values[each.target] = Value { Known::Integer, false, "0" };
+                break;
+            case Opcode::Istore:
+                values[each.target] = Value { Known::Integer, truthy(each.text), each.text };
+                break;
+            case Opcode::Fstore:
+                values[each.target] = Value { Known::Float, false, each.text };
+                break;
+            case Opcode::Strstore:
+                values[each.target] = Value { Known::String, false, each.text };
+                break;
+            case Opcode::Not:
+                if (values[each.source].tested()) {
+                    values[each.target] = Value { Known::Boolean, not values[each.source].truth, "" };
+                } else {
+                    values[each.target] = nothing;
+                }
+                break;
+            case Opcode::Copy:
+                values[each.target] = values[each.source];
+                break;
+            case Opcode::Move:
+                if (each.target != each.source) {
+                    values[each.target] = values[each.source];
+                    values[each.source] = nothing;
+                }
+                break;
+            case Opcode::Arg:
+            case Opcode::Function:
+            case Opcode::Call:
+            case Opcode::Operand:
+                values[each.target] = nothing;
+                break;
+            default:
+                break;
+        }
+    }
 
-    // skip "="
-    ++offset;
+    void rewrite(size_type i, const Values& values) {
+        /*  Rewrites the instruction using values of registers before it is executed.
+         */
+        Instruction& each = code[i];
+        if (each.opcode == Opcode::Branch and values[each.source].tested()) {
+            if (values[each.source].truth) {
+                removed[i] = true;
+            } else {
+                each.opcode = Opcode::Jump;
+                each.source = no_register;
+            }
+        } else if ((each.opcode == Opcode::Copy or each.opcode == Opcode::Move) and each.target != each.source) {
+            const Value& value = values[each.source];
+            switch (value.known) {
+                case Known::Integer:
+                    each.opcode = (value.literal == "0" ? Opcode::Izero : Opcode::Istore);
+                    each.text = (value.literal == "0" ? "" : value.literal);
+                    break;
+                case Known::Float:
+                    each.opcode = Opcode::Fstore;
+                    each.text = value.literal;
+                    break;
+                case Known::String:
+                    each.opcode = Opcode::Strstore;
+                    each.text = value.literal;
+                    break;
+                default:
+                    return;
+            }
+            each.source = no_register;
+        } else if (each.opcode == Opcode::Param and values[each.source].known != Known::Nothing) {
+            for (unsigned r = 0; r < each.source; ++r) {
+                if (values[r] == values[each.source]) {
+                    each.source = r;
+                    break;
+                }
+            }
+        }
+    }
 
-    string function_to_call = tokens[offset++];
+    void fold() {
+        /*  Finds values of registers at the beginning of each block reachable from the first one,
+         *  then rewrites the reachable blocks and removes the rest.
+         */
+        pmr::vector<Values> entry(blocks.size(), memory);
+        pmr::vector<bool> reached(blocks.size(), false, memory);
+        pmr::vector<bool> pending(blocks.size(), false, memory);
+        pmr::vector<size_type> work(memory);
+        Values values(memory);
+
+        entry[0].assign(registers, nothing);
+        reached[0] = pending[0] = true;
+        work.push_back(0);
+        while (not work.empty()) {
+            size_type b = work.back();
+            work.pop_back();
+            pending[b] = false;
+
+            values = entry[b];
+            for (size_type i = blocks[b]; i < end(b); ++i) {
+                transfer(code[i], values);
+            }
+            successors(b, &values, [&](size_type s) {
+                bool changed = false;
+                if (not reached[s]) {
+                    reached[s] = changed = true;
+                    entry[s] = values;
+                } else {
+                    for (unsigned r = 0; r < registers; ++r) {
+                        if (entry[s][r].known != Known::Nothing and entry[s][r] != values[r]) {
+                            entry[s][r] = nothing;
+                            changed = true;
+                        }
+                    }
+                }
+                if (changed and not pending[s]) {
+                    pending[s] = true;
+                    work.push_back(s);
+                }
+            });
+        }
 
-    // skip opening "("
-    ++offset;
+        removed.assign(code.size(), false);
+        for (size_type b = 0; b < blocks.size(); ++b) {
+            if (not reached[b]) {
+                for (size_type i = blocks[b]; i < end(b); ++i) {
+                    // names of registers are not executed, and are kept for the reader
+                    removed[i] = (code[i].opcode != Opcode::Name);
+                }
+                continue;
+            }
+            values = entry[b];
+            for (size_type i = blocks[b]; i < end(b); ++i) {
+                Instruction before = code[i];
+                rewrite(i, values);
+                transfer(before, values);
+            }
+        }
+        code.erase(removed);
+    }
 
-    // FIXME: functions with "auto" parameters should be considered templates and
-    // have special routines for checking "actual" return type
-    // for now, let's assume the programmer knows what he's doing
-    string function_return_type = scope->function->env->functions.at(function_to_call);
-    if (scope->typeof(return_to, offset-4) != function_return_type and function_return_type != "auto") {
-        throw InvalidSyntax(offset, (
-                    "mismatched type of return target variable " + return_to + " of type " + scope->typeof(return_to, offset-4) + " and return type of function " + scope->getFunctionSignature(function_to_call).header()));
+    static bool pure(Opcode opcode) {
+        /*  Returns true if the only effect of the instruction is the value it stores in its target.
+         */
+        switch (opcode) {
+            case Opcode::Izero:
+            case Opcode::Istore:
+            case Opcode::Fstore:
+            case Opcode::Strstore:
+            case Opcode::Function:
+            case Opcode::Copy:
+                return true;
+            default:
+                return false;
+        }
     }
+    bool sweep(size_type b, pmr::vector<bool>& live, bool remove) {
+        /*  Turns registers live at the end of the block into registers live at its beginning.
+         *  If asked to, removes stores to registers that are not live after them (a store is
+         *  removed together with instructions nested in it).
+         *  Returns true if a removed store read some register, which may have made more stores dead.
+         */
+        bool swept = false;
+        for (size_type i = end(b); i > blocks[b];) {
+            size_type last = --i;
+            while (i > blocks[b] and code[i].nested) {
+                --i;
+            }
+            const Instruction& first = code[i];
+            if (remove and pure(first.opcode) and not live[first.target]) {
+                fill((removed.begin() + static_cast<ptrdiff_t>(i)), (removed.begin() + static_cast<ptrdiff_t>(last + 1)), true);
+                swept = (swept or first.source != no_register);
+                continue;
+            }
+            for (size_type k = (last + 1); k > i;) {
+                const Instruction& each = code[--k];
+                if (isDirective(each.opcode)) {
+                    continue;
+                }
+                if (each.opcode == Opcode::Return) {
+                    live[0] = true;
+                }
+                // result of call to register 0 is dropped
+                if (each.target != no_register and not (each.opcode == Opcode::Call and each.target == 0)) {
+                    live[each.target] = false;
+                }
+                if (each.source != no_register) {
+                    live[each.source] = true;
+                }
+            }
+        }
+        return swept;
+    }
+    bool eliminateDeadStores() {
+        /*  Finds registers live at the beginning of each block, then removes stores whose values
+         *  are never read.
+         *  Returns true if another round could remove more.
+         */
+        pmr::vector<pmr::vector<size_type>> predecessors(blocks.size(), memory);
+        for (size_type b = 0; b < blocks.size(); ++b) {
+            successors(b, nullptr, [&](size_type s) { predecessors[s].push_back(b); });
+        }
 
-    TokenVectorSize i = (processFrame(tokens, function_to_call, offset, scope, output) + 3);
-    output << "    call " << scope->registerof(return_to, (offset-4)) << ' ' << function_to_call << endl;
+        pmr::vector<pmr::vector<bool>> entry(blocks.size(), memory);
+        pmr::vector<bool> pending(blocks.size(), true, memory);
+        pmr::vector<size_type> work(memory);
+        pmr::vector<bool> live(memory);
+        for (size_type b = 0; b < blocks.size(); ++b) {
+            entry[b].assign(registers, false);
+            work.push_back(b);
+        }
+        auto exit = [&](size_type b) {
+            live.assign(registers, false);
+            successors(b, nullptr, [&](size_type s) {
+                for (unsigned r = 0; r < registers; ++r) {
+                    live[r] = (live[r] or entry[s][r]);
+                }
+            });
+        };
+        while (not work.empty()) {
+            size_type b = work.back();
+            work.pop_back();
+            pending[b] = false;
+
+            exit(b);
+            sweep(b, live, false);
+            if (live == entry[b]) {
+                continue;
+            }
+            entry[b] = live;
+            for (size_type p : predecessors[b]) {
+                if (not pending[p]) {
+                    pending[p] = true;
+                    work.push_back(p);
+                }
+            }
+        }
 
-    return i;
-}
+        removed.assign(code.size(), false);
+        bool swept = false;
+        for (size_type b = 0; b < blocks.size(); ++b) {
+            exit(b);
+            swept = (sweep(b, live, true) or swept);
+        }
+        code.erase(removed);
+        return swept;
+    }
 
-TokenVectorSize processBlock(const TokenVector& tokens, TokenVectorSize offset, Scope* scope, ostringstream& output);
+    public:
+        void propagate() {
+            for (size_type i = 0; i < code.size(); ++i) {
+                if (code[i].opcode == Opcode::Asm) {
+                    return;
+                }
+            }
+            if (code.size() == 0 or not split() or (blocks.size() * registers) > max_values) {
+                return;
+            }
+            fold();
+            for (unsigned round = 0; round < max_rounds and code.size() > 0 and split() and eliminateDeadStores(); ++round) {
+            }
+        }
 
-TokenVectorSize processIfStatement(const TokenVector& tokens, TokenVectorSize offset, Scope* scope, ostringstream& output) {
-    TokenVectorSize i = offset;
+        ConstantPropagation(Code& c, pmr::memory_resource* m):
+            code(c),
+            memory(m),
+            registers(c.registers()),
+            removed(m),
+            blocks(m),
+            jumps(m),
+            marks(m)
+        {}
+};
+
+struct InlineFunction {
+    /*  Code of a function that can be compiled into its call sites instead of being called.
+     *
+     *  Registers are those of the function, the inliner gives each of them a fresh register at every
+     *  call site.  Text of each instruction is kept at its index in texts, as the code of the function
+     *  is released once the function is compiled.
+     */
+    unsigned parameters;
+    unsigned registers;
+    vector<Instruction> code;
+    vector<string> texts;
+};
 
-    if (not support::str::isname(tokens[i])) {
-        throw InvalidSyntax(i, ("unexpected token in condition experssion: " + support::str::strencode(tokens[i].text())));
+void inlineFunctions(FunctionEnvironment& fenv) {
+    /*  Compiles recorded functions into their call sites, in place of frames and calls.
+     *  Arguments are copied (as parameters would be) to fresh registers, which the inlined code
+     *  works on, and the returned value is moved to the register the call would store it in.
+     */
+    Code& code = fenv.code;
+    const auto& recorded = fenv.env->inline_functions;
+    if (recorded.empty()) {
+        return;
     }
-    if (not scope->defined(tokens[i])) {
-        throw InvalidSyntax(i, ("undeclared variable in condition experssion: " + support::str::strencode(tokens[i].text())));
+    auto callee = [&code, &recorded](Code::size_type frame) -> const InlineFunction* {
+        if (code[frame].opcode != Opcode::Frame) {
+            return nullptr;
+        }
+        Code::size_type call = (frame + code[frame].number + 1);
+        if (call >= code.size() or code[call].opcode != Opcode::Call) {
+            return nullptr;
+        }
+        auto found = recorded.find(code[call].text);
+        if (found == recorded.end() or found->second->parameters != code[frame].number) {
+            return nullptr;
+        }
+        return found->second.get();
+    };
+    Code::size_type first = 0;
+    while (first < code.size() and callee(first) == nullptr) {
+        ++first;
+    }
+    if (first == code.size()) {
+        return;
     }
 
-    string if_test_variable_name = tokens[i++];
-    string false_branch_name = ("__" + scope->function->function_name + "_if_" + support::str::stringify(scope->function->ifs++));
-
-    if (tokens[i] != "{") {
-        throw InvalidSyntax(i, ("missing opening '{' in if-statement in function " + scope->function->header()));
+    Code inlined(&fenv.arena);
+    unsigned fresh = code.registers();
+    pmr::vector<unsigned> renamed(&fenv.arena);
+    // register the call stores its result in; result of call to register 0 is dropped
+    unsigned result = 0;
+    auto rename = [&renamed, &fresh, &result](unsigned r) {
+        // literals returned by the function are stored straight in the register of the result
+        if (r == 0) {
+            return result;
+        }
+        if (renamed[r] == no_register) {
+            renamed[r] = fresh++;
+        }
+        return renamed[r];
+    };
+    for (Code::size_type i = 0; i < code.size(); ++i) {
+        const InlineFunction* function = (i < first ? nullptr : callee(i));
+        if (function == nullptr) {
+            inlined.append(code[i]);
+            continue;
+        }
+        Code::size_type parameters = (i + 1);
+        Code::size_type call = (parameters + code[i].number);
+        result = code[call].target;
+
+        renamed.assign(function->registers, no_register);
+        for (vector<Instruction>::size_type k = 0; k < function->code.size(); ++k) {
+            const Instruction& each = function->code[k];
+            const string& text = function->texts[k];
+            // a returned literal (with instructions nested in it) is dropped along with the result
+            if (each.target == 0 and result == 0) {
+                continue;
+            }
+            switch (each.opcode) {
+                case Opcode::Arg:
+                    inlined.copy(rename(each.target), code[parameters + each.number].source);
+                    break;
+                case Opcode::Izero:
+                    inlined.izero(rename(each.target));
+                    break;
+                case Opcode::Istore:
+                case Opcode::Fstore:
+                case Opcode::Strstore:
+                    inlined.store(each.opcode, rename(each.target), text);
+                    break;
+                case Opcode::Not:
+                    inlined.append(Instruction { Opcode::Not, rename(each.target), rename(each.source), 0, "", each.nested });
+                    break;
+                case Opcode::Copy:
+                case Opcode::Move:
+                    inlined.move(result, rename(each.source));
+                    break;
+                case Opcode::Inlined:
+                    inlined.inlined(text, each.number);
+                    break;
+                case Opcode::Operand:
+                    inlined.operand(rename(each.target), text);
+                    break;
+                default:
+                    break;
+            }
+        }
+        i = call;
     }
-    scope->function->begin_balance += 1;
-
-    output << "    branch " << scope->registerof(if_test_variable_name, i) << ' ';
-    output << "+1 " << false_branch_name << '\n';
-
-    // skip opening "{"
-    ++i;
-
-    // FIXME: memory leaks on exceptions thrown
-    // this is not severe as when an exception is thrown the only course of action is to
-    // terminate the program since the comiler cannot recover from invalid source code
-    Scope *block_scope = new Scope(scope->function, scope);
-    i += processBlock(tokens, i, block_scope, output);
-    delete block_scope;
-
-    output << "    .mark: " << false_branch_name << '\n';
-
-    return (i - offset);
+    code = move(inlined);
 }
 
-TokenVectorSize processWhileStatement(const TokenVector& tokens, TokenVectorSize offset, Scope* scope, ostringstream& output) {
-    TokenVectorSize i = offset;
-
-    if (not support::str::isname(tokens[i])) {
-        throw InvalidSyntax(i, ("unexpected token in condition experssion: " + tokens[i].text()));
+void optimiseTailCalls(FunctionEnvironment& fenv) {
+    /*  Turns calls in tail position (calls whose value is returned right away, or in functions
+     *  returning nothing, calls followed by return) into tail calls, which reuse the frame of the caller.
+     *  Tail calls of the function itself become jumps back to its beginning, after its parameters
+     *  are given the values of the arguments.
+     */
+    using size_type = Code::size_type;
+    const size_type nowhere = numeric_limits<size_type>::max();
+    Code& code = fenv.code;
+
+    pmr::unordered_map<string_view, size_type> marks(&fenv.arena);
+    for (size_type i = 0; i < code.size(); ++i) {
+        if (code[i].opcode == Opcode::Mark) {
+            marks[code[i].text] = i;
+        }
     }
-    if (not scope->defined(tokens[i])) {
-        throw InvalidSyntax(i, ("undeclared variable in condition experssion: " + tokens[i].text()));
+    auto next = [&code, &marks, nowhere](size_type i) {
+        /*  Returns index of the instruction executed after the one at i, following jumps, or nowhere.
+         *  A path that does not lead anywhere visits every instruction at most once.
+         */
+        for (size_type steps = 0; steps <= code.size(); ++steps) {
+            if (++i >= code.size()) {
+                return nowhere;
+            }
+            if (code[i].opcode == Opcode::Jump) {
+                auto found = marks.find(code[i].text);
+                if (found == marks.end()) {
+                    return nowhere;
+                }
+                i = found->second;
+            } else if (not isDirective(code[i].opcode)) {
+                return i;
+            }
+        }
+        return nowhere;
+    };
+
+    // registers of parameters, as loaded at the beginning of the function
+    pmr::vector<unsigned> parameters(&fenv.arena);
+    // the function begins again after the last of them
+    size_type entry = 0;
+    for (size_type i = 0; i < code.size() and (code[i].opcode == Opcode::Name or code[i].opcode == Opcode::Arg); ++i) {
+        if (code[i].opcode == Opcode::Arg and code[i].number == parameters.size()) {
+            parameters.push_back(code[i].target);
+            entry = (i + 1);
+        }
     }
 
-    string if_test_variable_name = tokens[i++];
-    string loop_name_begin = ("__" + scope->function->function_name + "_begin_while_" + support::str::stringify(scope->function->whiles++));
-    string loop_name_end = ("__" + scope->function->function_name + "_end_while_" + support::str::stringify(scope->function->whiles));
-
-    string prev_loop_begin = scope->function->loop_begin;
-    string prev_loop_end = scope->function->loop_end;
-    scope->function->loop_begin = loop_name_begin;
-    scope->function->loop_end = loop_name_end;
+    // frames of calls of the function itself in tail position
+    pmr::vector<bool> recursive(code.size(), false, &fenv.arena);
+    bool recurses = false;
+    for (size_type i = 0; i < code.size(); ++i) {
+        Instruction& call = code[i];
+        if (call.opcode != Opcode::Call) {
+            continue;
+        }
+        size_type following = next(i);
+        if (call.target != 0) {
+            if (following == nowhere or (code[following].opcode != Opcode::Move and code[following].opcode != Opcode::Copy) or
+                    code[following].target != 0 or code[following].source != call.target) {
+                continue;
+            }
+            following = next(following);
+        } else if (fenv.return_type != TypeTable::void_type) {
+            // result of call to register 0 is dropped, and the function returns some other value
+            continue;
+        }
+        if (following == nowhere or code[following].opcode != Opcode::Return) {
+            continue;
+        }
 
-    if (tokens[i] != "{") {
-        throw InvalidSyntax(i, ("missing opening '{' in while-statement in function " + scope->function->header()));
+        // parameters of the frame are the instructions right before the call
+        size_type frame = i;
+        while (frame > 0 and code[frame - 1].opcode == Opcode::Param) {
+            --frame;
+        }
+        if (call.text == fenv.function_name and frame > 0 and code[frame - 1].opcode == Opcode::Frame and
+                code[frame - 1].number == parameters.size() and (i - frame) == parameters.size()) {
+            recursive[frame - 1] = recurses = true;
+        } else {
+            call.opcode = Opcode::Tailcall;
+            call.target = no_register;
+        }
+    }
+    if (not recurses) {
+        return;
     }
-    scope->function->begin_balance += 1;
-
-    output << "    .mark: " << loop_name_begin << '\n';
-    output << "    branch " << scope->registerof(if_test_variable_name, i) << ' ';
-    output << "+1 " << loop_name_end << '\n';
-
-    // skip opening "{"
-    ++i;
-
-    // FIXME: memory leaks on exceptions thrown
-    // this is not severe as when an exception is thrown the only course of action is to
-    // terminate the program since the comiler cannot recover from invalid source code
-    Scope* block_scope = new Scope(scope->function, scope);
-    i += processBlock(tokens, i, block_scope, output);
-    delete block_scope;
 
-    output << "    jump " << loop_name_begin << '\n';
-    output << "    .mark: " << loop_name_end << '\n';
+    Code rewritten(&fenv.arena);
+    string label = ("__" + fenv.function_name + "_begin_function");
+    unsigned fresh = code.registers();
+    for (size_type i = 0; i < code.size(); ++i) {
+        if (i == entry) {
+            rewritten.mark(label);
+        }
+        if (not recursive[i]) {
+            rewritten.append(code[i]);
+            continue;
+        }
 
-    scope->function->loop_begin = prev_loop_begin;
-    scope->function->loop_end = prev_loop_end;
+        // arguments may be read from parameters, which must not be overwritten before they are read
+        size_type arguments = (i + 1);
+        bool overlapping = false;
+        for (unsigned p = 0; p < parameters.size(); ++p) {
+            for (unsigned a = 0; a < parameters.size(); ++a) {
+                overlapping = (overlapping or (a != p and code[arguments + a].source == parameters[p]));
+            }
+        }
+        for (unsigned p = 0; p < parameters.size(); ++p) {
+            unsigned source = code[arguments + p].source;
+            if (source != parameters[p]) {
+                rewritten.copy((overlapping ? (fresh + p) : parameters[p]), source);
+            }
+        }
+        for (unsigned p = 0; overlapping and p < parameters.size(); ++p) {
+            if (code[arguments + p].source != parameters[p]) {
+                rewritten.move(parameters[p], (fresh + p));
+            }
+        }
+        rewritten.jump(label);
+        // skip the frame and the call
+        i = (arguments + parameters.size());
+    }
+    code = move(rewritten);
+}
 
-    return (i - offset);
+void propagateConstants(FunctionEnvironment& fenv) {
+    ConstantPropagation propagation(fenv.code, &fenv.arena);
+    propagation.propagate();
 }
 
-TokenVectorSize processClass(const TokenVector& tokens, TokenVectorSize offset, CompilationEnvironment& cenv, ostringstream& output, const string& namespace_prefix = "") {
-    TokenVectorSize number_of_processed_tokens = 0;
+void optimisePeephole(FunctionEnvironment& fenv) {
+    Peephole peephole(fenv.code, &fenv.arena);
+    peephole.optimise();
 
-    string name = tokens[offset + (number_of_processed_tokens++)];
-    if (namespace_prefix.size()) {
-        name = (namespace_prefix + "::" + name);
+    if (fenv.env->peephole_report) {
+        *fenv.env->peephole_report << fenv.function_name << ": " << (peephole.instructions_before - peephole.instructions_after);
+        *fenv.env->peephole_report << " instructions removed (" << peephole.instructions_before << " before peephole optimisation)" << endl;
     }
-
-    Class klass(name);
-
-    cenv.classes[name] = klass;
-
-    return number_of_processed_tokens;
 }
 
-TokenVectorSize processFunction(const TokenVector& tokens, TokenVectorSize offset, CompilationEnvironment& cenv, ostringstream& output, const string& namespace_prefix = "") {
-    TokenVectorSize number_of_processed_tokens = 0;
+void allocateRegisters(FunctionEnvironment& fenv) {
+    RegisterAllocator allocator(fenv.code, &fenv.arena);
+    allocator.allocate();
 
-    string name = tokens[offset + (number_of_processed_tokens++)];
-    if (namespace_prefix.size()) {
-        name = (namespace_prefix + "::" + name);
+    if (fenv.env->register_report) {
+        *fenv.env->register_report << fenv.function_name << ": " << allocator.registers_after << " registers";
+        *fenv.env->register_report << " (" << allocator.registers_before << " before allocation)" << endl;
     }
-    FunctionEnvironment fenv(name, &cenv);
-    Scope* scope = fenv.scope;
+}
 
-    if ((offset+number_of_processed_tokens+2) >= tokens.size() or tokens[offset+number_of_processed_tokens] !=  "(") {
-        throw InvalidSyntax((offset+number_of_processed_tokens), ("missing parameter list in definition of function " + fenv.header()));
-    }
+class PassManager {
+    /*  Passes run over the code of each compiled function, in the order they were added.
+     *
+     *  Every pass runs from some optimisation level up, and can also be enabled or disabled by
+     *  name regardless of the level (-f<name> and -fno-<name> on the command line).
+     *  Time spent in each pass is accumulated over all compiled functions.
+     */
+    public:
+        using Run = void (*)(FunctionEnvironment&);
+        static const unsigned max_level = 2;
+
+        // largest function (in instructions) inlined at its call sites
+        unsigned inline_limit;
+
+    private:
+        struct Pass {
+            string name;
+            // lowest optimisation level the pass runs at
+            unsigned level;
+            Run run;
+            // set when the pass is enabled or disabled by name
+            optional<bool> forced;
+
+            chrono::steady_clock::duration time;
+            unsigned long functions;
+        };
+
+        vector<Pass> passes;
+        unsigned optimisation_level;
+        // functions never inlined, whatever their size
+        vector<string> not_inlined;
+
+        bool enabled(const Pass& pass) const {
+            return pass.forced.value_or(pass.level <= optimisation_level);
+        }
 
+    public:
+        void add(const string& name, unsigned level, Run run) {
+            passes.push_back(Pass { name, level, run, {}, chrono::steady_clock::duration::zero(), 0 });
+        }
 
-    // skip opening "("
-    ++number_of_processed_tokens;
+        void level(unsigned l) {
+            optimisation_level = l;
+        }
+        bool enable(const string& name, bool enabled) {
+            /*  Returns false if there is no pass with such name.
+             */
+            for (auto& each : passes) {
+                if (each.name == name) {
+                    each.forced = enabled;
+                    return true;
+                }
+            }
+            return false;
+        }
 
-    decltype(offset) i = offset+number_of_processed_tokens;
-    string param_name, param_type;
-    for (; i < tokens.size() and tokens[i] != ")"; ++i) {
-        param_type = tokens[i++];
+        void run(FunctionEnvironment& fenv) {
+            for (auto& each : passes) {
+                if (not enabled(each)) {
+                    continue;
+                }
+                auto begin = chrono::steady_clock::now();
+                each.run(fenv);
+                each.time += (chrono::steady_clock::now() - begin);
+                ++each.functions;
+            }
+        }
 
-        if (not scope->isRegisteredClass(param_type)) {
-            throw InvalidSyntax(i-1, ("invalid parameter type in function " + scope->function->header() + ": " + param_type));
+        void exclude(const string& function) {
+            not_inlined.push_back(function);
+        }
+        bool inlinable(const string& function) const {
+            return (find(not_inlined.begin(), not_inlined.end(), function) == not_inlined.end());
         }
 
-        param_name = tokens[i];
-        if (not support::str::isname(param_name)) {
-            throw InvalidSyntax(i, ("invalid parameter name in function " + scope->function->header() + ": " + param_name));
+        void clearTimes() {
+            for (auto& each : passes) {
+                each.time = chrono::steady_clock::duration::zero();
+                each.functions = 0;
+            }
+        }
+        void report(ostream& output) const {
+            output << "time spent in passes (-O" << optimisation_level << "):" << endl;
+            for (const auto& each : passes) {
+                output << "    " << each.name << ": ";
+                if (enabled(each)) {
+                    output << (static_cast<double>(chrono::duration_cast<chrono::microseconds>(each.time).count()) / 1000.0) << " ms";
+                    output << " in " << each.functions << " functions" << endl;
+                } else {
+                    output << "disabled" << endl;
+                }
+            }
         }
 
-        fenv.parameters.push_back(param_name);
-        fenv.parameter_types[param_name] = param_type;
-        fenv.parameter_var_length[param_name] = false;
-        if (tokens[i+1] == ",") {
-            ++i;
-        } else if (tokens[i+1] == ")") {
-            // explicitly do nothing
-        } else if (tokens[i+1] == "...") {
-            fenv.parameter_var_length[param_name] = true;
-            ++i;
-        } else {
-            throw InvalidSyntax(i+1, ("unexpected token in parameters list of function " + fenv.function_name + ": " + tokens[i+1].text()));
+        PassManager(): inline_limit(8), optimisation_level(1) {
+            add("inline", 1, inlineFunctions);
+            add("tail-calls", 1, optimiseTailCalls);
+            add("constant-propagation", 2, propagateConstants);
+            add("peephole", 1, optimisePeephole);
+            add("register-allocation", 1, allocateRegisters);
         }
-        number_of_processed_tokens += 3;
-    }
+};
 
-    // this if is in case the function has no parameters and
-    // must be here because the for above wasn't entered
-    if (tokens[offset+number_of_processed_tokens] == ")") {
-        ++number_of_processed_tokens;
+void recordInlineFunction(FunctionEnvironment& fenv) {
+    /*  Records the function for inlining if its body is a single asm statement (with variables
+     *  it may use and a value it may return), it is small enough, and it is not excluded from inlining.
+     *
+     *  Names used by the asm statement are replaced with the registers they name, so every word of
+     *  the statement but the first must name a parameter or a variable of the function.
+     */
+    // instructions that refer to the frame or change control flow would mean something else at the call site
+    static const char* const control[] = {
+        "arg", "argc", "call", "tailcall", "defer", "process", "frame", "param", "pamv",
+        "return", "jump", "branch", "throw", "catch", "try", "enter", "leave", "halt", "self",
+    };
+
+    CompilationEnvironment& cenv = *fenv.env;
+    cenv.inline_functions.erase(fenv.function_name);
+    if (not cenv.passes->inlinable(fenv.function_name)) {
+        return;
     }
 
-    if ((offset+number_of_processed_tokens+2) >= tokens.size() and tokens[offset+number_of_processed_tokens] != "{") {
-        throw InvalidSyntax((offset+number_of_processed_tokens), ("unexpected end of token stream in definition of function " + fenv.function_name));
+    const Code& code = fenv.code;
+    // most functions are not wrappers of asm statements, and are rejected before anything is allocated
+    unsigned statements = 0;
+    for (Code::size_type i = 0; i < code.size(); ++i) {
+        statements += (code[i].opcode == Opcode::Asm ? 1 : 0);
+    }
+    if (statements != 1) {
+        return;
+    }
+    auto function = make_shared<InlineFunction>();
+    function->parameters = 0;
+    function->registers = code.registers();
+    pmr::unordered_map<string_view, unsigned> names(&fenv.arena);
+    unsigned size = 0;
+    for (Code::size_type i = 0; i < code.size(); ++i) {
+        const Instruction& each = code[i];
+        switch (each.opcode) {
+            case Opcode::Name:
+                names[each.text] = each.target;
+                continue;
+            case Opcode::Return:
+                if ((i + 1) != code.size()) {
+                    return;
+                }
+                continue;
+            case Opcode::Arg:
+                ++function->parameters;
+                break;
+            case Opcode::Izero:
+            case Opcode::Istore:
+            case Opcode::Fstore:
+            case Opcode::Strstore:
+            case Opcode::Not:
+                break;
+            case Opcode::Copy:
+            case Opcode::Move:
+                // the returned value
+                if (each.target != 0) {
+                    return;
+                }
+                break;
+            case Opcode::Asm: {
+                // words of the statement are its tokens, joined with spaces
+                vector<string_view> words;
+                for (string_view::size_type at = 0, space = 0; at < each.text.size(); at = (space + 1)) {
+                    space = min(each.text.find(' ', at), each.text.size());
+                    if (space > at) {
+                        words.push_back(each.text.substr(at, (space - at)));
+                    }
+                }
+                if (words.empty() or find(begin(control), end(control), words[0]) != end(control)) {
+                    return;
+                }
+                function->code.push_back(Instruction { Opcode::Inlined, no_register, no_register, static_cast<unsigned>(words.size() - 1), "", false });
+                function->texts.push_back(string(words[0]) + ' ');
+                for (auto word = (words.begin() + 1); word != words.end(); ++word) {
+                    auto found = names.find(*word);
+                    if (found == names.end()) {
+                        return;
+                    }
+                    function->code.push_back(Instruction { Opcode::Operand, found->second, found->second, 0, "", false });
+                    function->texts.push_back(" ");
+                }
+                ++size;
+                continue;
+            }
+            default:
+                return;
+        }
+        function->code.push_back(each);
+        function->texts.push_back(string(each.text));
+        ++size;
     }
-    if ((tokens[offset+number_of_processed_tokens] != "-" or tokens[offset+number_of_processed_tokens+1] != ">") and tokens[offset+number_of_processed_tokens] != "{" and tokens[offset+number_of_processed_tokens] != ";") {
-        throw InvalidSyntax(
-                (offset+number_of_processed_tokens),
-                ("missing return type specifier in definition of function " + fenv.function_name +
-                 ", expected '->' but got: '" +
-                 support::str::strencode(tokens[offset+number_of_processed_tokens]) +
-                 support::str::strencode(tokens[offset+number_of_processed_tokens+1]) +
-                 "'\ntwo previous tokens: " +
-                 support::str::strencode(tokens[offset+number_of_processed_tokens-2]) +
-                 support::str::strencode(tokens[offset+number_of_processed_tokens-1]) +
-                 ""
-                 ));
+    if (size <= cenv.passes->inline_limit) {
+        cenv.inline_functions[fenv.function_name] = function;
     }
+}
+
+void processBlock(const SyntaxTree& tree, NodeIndex body, Scope* scope, Code& code);
+
+void processFunction(const SyntaxTree& tree, NodeIndex function, CompilationEnvironment& cenv, ostringstream& output) {
+    const TokenVector& tokens = tree.tokens();
+    FunctionEnvironment fenv(tokens[tree.token(function)], &cenv);
+    Scope* scope = fenv.scope;
 
-    if (tokens[offset+number_of_processed_tokens] == "-") {
-        // skip over "-" and ">" that make up return type specifier
-        number_of_processed_tokens += 2;
-        fenv.return_type = tokens[offset + (number_of_processed_tokens++)];
-        if (not scope->isRegisteredClass(fenv.return_type)) {
-            throw InvalidSyntax((offset+number_of_processed_tokens), ("invalid return type in definition of function " + fenv.function_name));
+    NodeIndex body = no_node;
+    for (NodeIndex child = tree.lhs(function); child != no_node; child = tree.next(child)) {
+        if (tree.kind(child) == NodeKind::Parameter) {
+            fenv.parameters.emplace_back(tokens[tree.lhs(child)].view());
+            fenv.parameter_types[fenv.parameters.back()] = cenv.types.find(tokens[tree.token(child)]);
+        } else {
+            body = child;
         }
-        if (fenv.return_type == "auto") {
+    }
+    if (tree.rhs(function) != no_token) {
+        fenv.return_type = cenv.types.find(tokens[tree.rhs(function)]);
+        if (fenv.return_type == TypeTable::auto_type) {
             fenv.automatic_return_type = true;
         }
     } else {
-        fenv.return_type = "void";
-    }
-
-    cenv.functions[fenv.function_name] = fenv.return_type;
-    cenv.signatures[fenv.function_name] = FunctionSignature(fenv.function_name, fenv.return_type);
-    cenv.signatures[fenv.function_name].parameters = fenv.parameters;
-    cenv.signatures[fenv.function_name].parameter_types = fenv.parameter_types;
-
-    if (tokens[offset+number_of_processed_tokens] == ";") {
-        return ++number_of_processed_tokens;
+        fenv.return_type = TypeTable::void_type;
     }
 
-    if (tokens[offset+number_of_processed_tokens] != "{") {
-        throw InvalidSyntax((offset+number_of_processed_tokens), ("missing opening '{' in definition of function " + fenv.header()));
+    if (body == no_node) {
+        return;
     }
 
-    // skip opening "{"
-    ++number_of_processed_tokens;
-    ++fenv.begin_balance;
-
     output << ".function: " << fenv.function_name << endl;
 
     for (decltype(FunctionEnvironment::parameters)::size_type i = 0; i < fenv.parameters.size(); ++i) {
-        output << "    .name: " << i+1 << ' ' << fenv.parameters[i] << endl;
-        output << "    arg " << i+1 << ' ' << i << endl;
-        scope->setregisterof(fenv.parameters[i], i+1);
-        scope->settypeof(fenv.parameters[i], fenv.parameter_types[fenv.parameters[i]]);
+        fenv.code.name(static_cast<unsigned>(i+1), fenv.parameters[i]);
+        fenv.code.arg(static_cast<unsigned>(i+1), static_cast<unsigned>(i));
+        scope->define(fenv.parameters[i], static_cast<unsigned>(i+1), fenv.parameter_types[fenv.parameters[i]]);
     }
 
-    number_of_processed_tokens += processBlock(tokens, (offset+number_of_processed_tokens), scope, output);
+    processBlock(tree, body, scope, fenv.code);
 
     if (not fenv.has_returned) {
-        output << "    return" << endl;
+        fenv.code.ret();
     }
-    if (not fenv.has_returned and fenv.return_type != "void") {
-        throw InvalidSyntax(i, ("function " + fenv.header() + " declared return type " + fenv.return_type + " but reached end of definition without return statement"));
+    if (not fenv.has_returned and fenv.return_type != TypeTable::void_type) {
+        throw InvalidSyntax(tree.end(function), ("function " + fenv.header() + " declared return type " + cenv.types.name(fenv.return_type) + " but reached end of definition without return statement"));
     }
-    output << ".end" << endl;
 
-    return number_of_processed_tokens;
+    recordInlineFunction(fenv);
+    // passes see the whole function
+    cenv.passes->run(fenv);
+    fenv.code.serialize(output);
+    output << ".end" << endl;
 }
 
 TokenVectorSize processNamespace(const TokenVector& tokens, TokenVectorSize offset, CompilationEnvironment& cenv, ostringstream& output) {
@@ -1754,136 +5152,454 @@ TokenVectorSize processNamespace(const TokenVector& tokens, TokenVectorSize offs
     return (number_of_processed_tokens-offset);
 }
 
-TokenVectorSize processBlock(const TokenVector& tokens, TokenVectorSize offset, Scope* scope, ostringstream& output) {
-    TokenVectorSize number_of_processed_tokens = 0;
-
-    for (; number_of_processed_tokens+offset < tokens.size() and scope->function->begin_balance; ++number_of_processed_tokens) {
-        if (tokens[offset+number_of_processed_tokens] == "var") {
-            number_of_processed_tokens += processVariable(tokens, (offset + (++number_of_processed_tokens)), scope, output);
-        } else if (tokens[offset+number_of_processed_tokens] == "return") {
-            scope->function->has_returned = true;
-
-            // skip "return" keyword
-            ++number_of_processed_tokens;
-
-            // this if deals with `return <token> ;` case
-            if (tokens[offset + number_of_processed_tokens] != ";") {
-                // this if deals with `return <number> ;` case
-                if (support::str::isnum(tokens[offset+number_of_processed_tokens])) {
-                    if (scope->function->return_type == "auto") {
-                        scope->function->return_type = "int";
-                    }
-                    if (scope->function->return_type != "int") {
-                        throw InvalidSyntax((offset+number_of_processed_tokens), ("mismatched return type in function " + scope->function->header() + ", expected " + scope->function->return_type + " but got int"));
-                    }
-                    if (tokens[offset+number_of_processed_tokens] == "0") {
-                        output << "    izero 0" << endl;
+void processBlock(const SyntaxTree& tree, NodeIndex body, Scope* scope, Code& code) {
+    /*  Compiles statements of the body of a function, and of all blocks nested in it.
+     *
+     *  Nested blocks are opened on an explicit stack instead of by recursion, so that deeply
+     *  nested code does not exhaust the native stack.
+     */
+    const TokenVector& tokens = tree.tokens();
+    BlockStack blocks(&scope->function->arena);
+    blocks.open(BlockStack::Kind::Body, tree.lhs(body), scope);
+
+    while (true) {
+        BlockStack::Block* block = &blocks.top();
+        Scope* block_scope = block->scope;
+        NodeIndex statement = block->at;
+
+        if (statement != no_node) {
+            // advanced before compiling the statement, opening a nested block invalidates the reference
+            block->at = tree.next(statement);
+
+            TokenVectorSize i = tree.token(statement);
+            switch (tree.kind(statement)) {
+                case NodeKind::Variable:
+                    processVariable(tree, statement, block_scope, code);
+                    break;
+                case NodeKind::Return:
+                    block_scope->function->has_returned = true;
+
+                    // this if deals with `return <token> ;` case
+                    if (tree.lhs(statement) != no_token) {
+                        // this if deals with `return <number> ;` case
+                        if (tokens[i].kind() == TokenKind::Integer) {
+                            if (block_scope->function->return_type == TypeTable::auto_type) {
+                                block_scope->function->return_type = TypeTable::int_type;
+                            }
+                            if (block_scope->function->return_type != TypeTable::int_type) {
+                                throw InvalidSyntax(i, ("mismatched return type in function " + block_scope->function->header() + ", expected " + block_scope->types().name(block_scope->function->return_type) + " but got int"));
+                            }
+                            if (tokens[i] == "0") {
+                                code.izero(0);
+                            } else {
+                                code.store(Opcode::Istore, 0, tokens[i]);
+                            }
+                        } else {
+                            const Variable& returned = block_scope->lookup(string(tokens[i]), i);
+                            if (returned.register_index != 0) {
+                                if (block_scope->function->return_type == TypeTable::auto_type) {
+                                    block_scope->function->return_type = returned.type;
+                                }
+                                if (block_scope->function->return_type != returned.type) {
+                                    throw InvalidSyntax(i, ("mismatched return type in function " + block_scope->function->header() + ", expected " + block_scope->types().name(block_scope->function->return_type) + " but got " + block_scope->types().name(returned.type)));
+                                }
+                                code.move(0, returned.register_index);
+                            }
+                        }
                     } else {
-                        output << "    istore 0 " << tokens[offset+number_of_processed_tokens].text() << endl;
-                    }
-                } else if (scope->registerof(tokens[offset+number_of_processed_tokens], offset+number_of_processed_tokens) != 0) {
-                    if (scope->function->return_type == "auto") {
-                        scope->function->return_type = scope->typeof(tokens[offset+number_of_processed_tokens], offset+number_of_processed_tokens);
+                        if (block_scope->function->return_type != TypeTable::void_type) {
+                            throw InvalidSyntax(i, ("mismatched return type in function " + block_scope->function->header() + ", expected " + block_scope->types().name(block_scope->function->return_type) + " but got void"));
+                        }
                     }
-                    if (scope->function->return_type != scope->typeof(tokens[offset+number_of_processed_tokens], offset+number_of_processed_tokens)) {
-                        throw InvalidSyntax((offset+number_of_processed_tokens), ("mismatched return type in function " + scope->function->header() + ", expected " + scope->function->return_type + " but got " + scope->typeof(tokens[offset+number_of_processed_tokens], offset+number_of_processed_tokens)));
+
+                    code.ret();
+                    break;
+                case NodeKind::Asm: {
+                    string text;
+                    for (TokenVectorSize k = (i + 1); k < tree.end(statement); ++k) {
+                        text += tokens[k];
+                        text += ' ';
                     }
-                    output << "    move 0 " << scope->registerof(tokens[offset+number_of_processed_tokens], offset+number_of_processed_tokens) << endl;
+                    code.assembly(text);
+                    break;
                 }
+                case NodeKind::Block:
+                    blocks.open(BlockStack::Kind::Bare, tree.lhs(statement), block_scope);
+                    break;
+                case NodeKind::Break:
+                    if (block_scope->function->loop_end == "") {
+                        throw InvalidSyntax(i, ("break outside of loop inside function " + block_scope->function->header()));
+                    }
+                    code.comment("from break instruction");
+                    code.jump(block_scope->function->loop_end);
+                    break;
+                case NodeKind::If:
+                    processIfStatement(tree, statement, block_scope, code, blocks);
+                    break;
+                case NodeKind::While:
+                    processWhileStatement(tree, statement, block_scope, code, blocks);
+                    break;
+                case NodeKind::Call:
+                    processCall(tree, statement, block_scope, code);
+                    break;
+                case NodeKind::Assignment:
+                    processCallWithReturnValueUsed(tree, statement, block_scope, code);
+                    break;
+                case NodeKind::Error:
+                    throw InvalidSyntax(i, tree.message(statement));
+                default:
+                    throw InvalidSyntax(i, "unexpected node in block");
+            }
+            continue;
+        }
 
-                // advance after the returned <token>
-                ++number_of_processed_tokens;
-            } else {
-                if (scope->function->return_type != "void") {
-                    throw InvalidSyntax((offset+number_of_processed_tokens), ("mismatched return type in function " + scope->function->header() + ", expected " + scope->function->return_type + " but got void"));
+        switch (block->kind) {
+            case BlockStack::Kind::Body:
+                return;
+            case BlockStack::Kind::Bare:
+                blocks.close();
+                break;
+            case BlockStack::Kind::If:
+                code.mark(block->end_label);
+                blocks.close();
+                break;
+            case BlockStack::Kind::While:
+                code.jump(block->begin_label);
+                code.mark(block->end_label);
+                block_scope->function->loop_begin = block->enclosing_loop_begin;
+                block_scope->function->loop_end = block->enclosing_loop_end;
+                blocks.close();
+                break;
+        }
+    }
+}
+
+class CallGraph {
+    /*  Functions defined at the top level of a source, and functions reachable from given ones.
+     *
+     *  Bodies are found by matching braces, without parsing them.
+     *  A function reaches every function whose name appears in its body (called directly, passed
+     *  as an argument or stored in a variable), so a function may be reached without being used
+     *  but is never missed.
+     */
+    const TokenVector& tokens;
+    // beginning and end of bodies defined under each name; a name may be defined more than once
+    unordered_map<Symbol, vector<pair<TokenVectorSize, TokenVectorSize>>> bodies;
+    vector<bool> reachable;
+
+    public:
+        void reach(Symbol root) {
+            /*  Marks the function and all functions reachable from it.
+             */
+            if (root == no_symbol or reachable[root]) {
+                return;
+            }
+            vector<Symbol> work { root };
+            reachable[root] = true;
+            while (not work.empty()) {
+                Symbol name = work.back();
+                work.pop_back();
+                auto found = bodies.find(name);
+                if (found == bodies.end()) {
+                    continue;
+                }
+                for (const auto& body : found->second) {
+                    for (TokenVectorSize i = body.first; i < body.second; ++i) {
+                        Symbol mentioned = tokens[i].symbol();
+                        if (mentioned != no_symbol and not reachable[mentioned] and bodies.count(mentioned)) {
+                            reachable[mentioned] = true;
+                            work.push_back(mentioned);
+                        }
+                    }
                 }
             }
+        }
+        bool reached(Symbol name) const {
+            return (name != no_symbol and reachable[name]);
+        }
 
-            // no need to deal with terminating ";" as loop increment will take care of it
-            output << "    return" << endl;
-        } else if (tokens[offset+number_of_processed_tokens] == "asm") {
-            output << "    ";
-            while (tokens[offset + (++number_of_processed_tokens)] != ";") {
-                output << tokens[offset+number_of_processed_tokens].text() << ' ';
+        CallGraph(const TokenVector& t): tokens(t), reachable(t.symbols().size(), false) {
+            for (TokenVectorSize i = 0; i < tokens.size(); ++i) {
+                if (tokens[i].kind() != TokenKind::Function or (i + 1) >= tokens.size()) {
+                    continue;
+                }
+                Symbol name = tokens[i + 1].symbol();
+                TokenVectorSize begin = (i + 2), depth = 0;
+                for (i = begin; i < tokens.size(); ++i) {
+                    TokenKind kind = tokens[i].kind();
+                    if (kind == TokenKind::LeftBrace) {
+                        ++depth;
+                    } else if ((kind == TokenKind::RightBrace and depth > 0 and --depth == 0) or (kind == TokenKind::Semicolon and depth == 0)) {
+                        break;
+                    }
+                }
+                if (name != no_symbol) {
+                    bodies[name].emplace_back(begin, min(i, tokens.size()));
+                }
             }
-            output << endl;
-        } else if (tokens[offset+number_of_processed_tokens] == ";") {
-            continue;
-        } else if (tokens[offset+number_of_processed_tokens] == "{") {
-            scope->function->begin_balance += 1;
-
-            Scope* block_scope = new Scope(scope->function, scope);
-            number_of_processed_tokens += processBlock(tokens, (offset + (++number_of_processed_tokens)), block_scope, output);
-            delete block_scope;
+        }
+};
 
-            // skip closing "}" for nested blocks
-            ++number_of_processed_tokens;
-        } else if (tokens[offset+number_of_processed_tokens] == "}") {
-            scope->function->begin_balance -= 1;
-            break;
-        } else if (tokens[offset+number_of_processed_tokens] == "break") {
-            if (scope->function->loop_end == "") {
-                throw InvalidSyntax((offset+number_of_processed_tokens), ("break outside of loop inside function " + scope->function->header()));
-            }
-            output << "    ; from break instruction" << endl;
-            output << "    jump " << scope->function->loop_end << '\n';
-        } else if (tokens[offset+number_of_processed_tokens] == "if") {
-            number_of_processed_tokens += processIfStatement(tokens, (offset + (++number_of_processed_tokens)), scope, output);
-        } else if (tokens[offset+number_of_processed_tokens] == "while") {
-            number_of_processed_tokens += processWhileStatement(tokens, (offset + (++number_of_processed_tokens)), scope, output);
-        } else {
-            if ((offset+number_of_processed_tokens+3) >= tokens.size()) {
-                throw InvalidSyntax(
-                        (offset+number_of_processed_tokens),
-                        ("missing tokens during call to " + tokens[offset+number_of_processed_tokens].text())
-                      );
-            } else if (tokens[offset+number_of_processed_tokens+1] == "(") {
-                number_of_processed_tokens += processCall(tokens, (offset + number_of_processed_tokens), scope, output);
-            } else if (scope->defined(tokens[offset+number_of_processed_tokens]) and tokens[offset+number_of_processed_tokens+1] == "=" and tokens[offset+number_of_processed_tokens+3] == "(") {
-                number_of_processed_tokens += processCallWithReturnValueUsed(tokens, (offset+number_of_processed_tokens), scope, output);
-            } else {
-                throw InvalidSyntax((offset+number_of_processed_tokens),
-                        ("unexpected token: " + support::str::strencode(tokens[offset+number_of_processed_tokens])));
+TokenVectorSize processDeclaration(const TokenVector& tokens, TokenVectorSize offset, CompilationEnvironment& cenv, Parser& parser, ostringstream& output, const CallGraph* graph = nullptr) {
+    /*  Processes top-level declaration at offset.
+     *  If a call graph is given, functions it has not reached are declared but not compiled.
+     *  Returns number of tokens consumed.
+     */
+    TokenVectorSize i = offset;
+    switch (tokens[i].kind()) {
+        case TokenKind::Function: {
+            ++i;
+            if (graph != nullptr and not graph->reached(tokens[i].symbol())) {
+                parser.parseFunction(i, true);
+                break;
             }
+            NodeIndex function = parser.parseFunction(i);
+            processFunction(parser.syntax(), function, cenv, output);
+            break;
+        }
+        case TokenKind::Class:
+            ++i;
+            i += processClass(tokens, i, cenv, output);
+            break;
+        case TokenKind::Newline:
+            // explicitly do nothing
+            break;
+        case TokenKind::Namespace:
+            ++i;
+            i += processNamespace(tokens, i, cenv, output);
+            break;
+        default:
+            throw InvalidSyntax(i, ("invalid top-level token: " + support::str::strencode(tokens[i].text())));
+    }
+    return (i - offset + 1);
+}
+
+void processSource(const TokenVector& tokens, ostringstream& output, ostream* register_report = nullptr, PassManager* passes = nullptr, ostream* peephole_report = nullptr,
+        const vector<string>* exported = nullptr) {
+    /*  Compiles the source.
+     *  If exported names are given, only functions reachable from main() or from one of the names are compiled.
+     */
+    PassManager default_passes;
+    CompilationEnvironment cenv(tokens.symbols(), register_report, (passes ? passes : &default_passes), peephole_report);
+    SyntaxTree tree(tokens);
+    Parser parser(tokens, cenv, tree);
+
+    unique_ptr<CallGraph> graph;
+    if (exported != nullptr) {
+        graph.reset(new CallGraph(tokens));
+        graph->reach(tokens.symbols().find("main"));
+        for (const auto& each : *exported) {
+            graph->reach(tokens.symbols().find(each));
         }
     }
 
-    return number_of_processed_tokens;
+    for (TokenVectorSize i = 0; i < tokens.size(); i += processDeclaration(tokens, i, cenv, parser, output, graph.get()));
+
+    if (cenv.signatures.find("main") == nullptr) {
+        cout << "warning: main()->int function was not defined" << endl;
+    }
 }
 
-void processSource(const TokenVector& tokens, ostringstream& output) {
-    string previous_token = "", token = "";
+class DeclarationBoundary {
+    /*  Finds the end of the top-level declaration at the beginning of a token window.
+     *
+     *  Functions end with the "}" that balances their first "{", or with ";" if they have no body.
+     *  Scanning is incremental so that feeding a window token by token stays linear.
+     */
+    TokenVectorSize scanned;
+    TokenVectorSize depth;
+    TokenVectorSize extent;
 
-    CompilationEnvironment cenv;
+    public:
+        TokenVectorSize find(const TokenVector& window) {
+            /*  Returns number of tokens the declaration spans, or 0 if its end has not been seen yet.
+             */
+            if (extent != 0 or window.size() == 0) {
+                return extent;
+            }
+            if (scanned == 0) {
+                scanned = 1;
+                switch (window[0].kind()) {
+                    case TokenKind::Class:
+                        return (extent = 2);
+                    case TokenKind::Namespace:
+                        return (extent = 4);
+                    case TokenKind::Function:
+                        break;
+                    default:
+                        return (extent = 1);
+                }
+            }
+            for (; scanned < window.size(); ++scanned) {
+                TokenKind kind = window[scanned].kind();
+                if (kind == TokenKind::LeftBrace) {
+                    ++depth;
+                } else if (kind == TokenKind::RightBrace and depth > 0 and --depth == 0) {
+                    return (extent = ++scanned);
+                } else if (kind == TokenKind::Semicolon and depth == 0) {
+                    return (extent = ++scanned);
+                }
+            }
+            return 0;
+        }
+        void reset() {
+            scanned = 0;
+            depth = 0;
+            extent = 0;
+        }
 
-    for (vector<string>::size_type i = 0; i < tokens.size(); ++i) {
-        token = tokens[i];
-        if (token == "function") {
-            i += processFunction(tokens, ++i, cenv, output);
-        } else if (token == "class") {
-            i += processClass(tokens, ++i, cenv, output);
-        } else if(token == "\n") {
-            // explicitly do nothing
-        } else if (token == "namespace") {
-            i += processNamespace(tokens, ++i, cenv, output);
-        } else {
-            throw InvalidSyntax(i, ("invalid top-level token: " + support::str::strencode(tokens[i].text())));
+        DeclarationBoundary(): scanned(0), depth(0), extent(0) {}
+};
+
+bool processSourceStreaming(const char* s, string::size_type n, TokenVector& window, ostream& output, ostream* register_report = nullptr, PassManager* passes = nullptr, ostream* peephole_report = nullptr) {
+    /*  Compiles the source one top-level declaration at a time.
+     *
+     *  Tokens are pulled from the lexer only until the window holds a complete declaration
+     *  (plus a few tokens of lookahead, the same the declaration would see when compiling
+     *  the whole token stream at once).
+     *  Output of each declaration is written as soon as it is compiled and its tokens are
+     *  dropped, so memory use depends on the largest declaration, not on the size of the source.
+     *
+     *  Malformed declarations may make the compiler read past their end.
+     *  If that happens before the source is exhausted the result could differ from compiling the whole
+     *  token stream, so false is returned and the caller has to compile the whole source instead.
+     */
+    const TokenVectorSize lookahead = 3;
+
+    support::str::Lexer lexer(s, n, window.symbols());
+    TokenNormalizer normalizer(window);
+    DeclarationBoundary boundary;
+    PassManager default_passes;
+    CompilationEnvironment cenv(window.symbols(), register_report, (passes ? passes : &default_passes), peephole_report);
+    SyntaxTree tree(window);
+    Parser parser(window, cenv, tree);
+    ostringstream declaration_output;
+
+    Token token;
+    bool exhausted = false;
+    while (true) {
+        TokenVectorSize extent = 0;
+        while (not exhausted and ((extent = boundary.find(window)) == 0 or window.size() < (extent + lookahead))) {
+            if (lexer.next(token)) {
+                normalizer.feed(token);
+            } else {
+                normalizer.finish();
+                exhausted = true;
+            }
         }
-        previous_token = token;
+        if (window.size() == 0) {
+            break;
+        }
+
+        TokenVectorSize consumed = 0;
+        window.resetReach();
+        try {
+            consumed = processDeclaration(window, 0, cenv, parser, declaration_output);
+        } catch (const InvalidSyntax&) {
+            if (not exhausted and window.reach() > extent) {
+                return false;
+            }
+            throw;
+        }
+        if (not exhausted and window.reach() > extent) {
+            return false;
+        }
+        output << declaration_output.str();
+        declaration_output.str("");
+        tree.clear();
+
+        window.discard(min(consumed, window.size()));
+        if (not normalizer.holdsSynthesized()) {
+            window.compact();
+        }
+        boundary.reset();
     }
 
-    if (cenv.signatures.count("main") == 0) {
+    if (cenv.signatures.find("main") == nullptr) {
         cout << "warning: main()->int function was not defined" << endl;
     }
+    return true;
+}
+
+void reportSyntaxError(const InvalidSyntax& e, const TokenVector& toks, const string& compilename, const support::io::MappedFile& source) {
+    auto token = toks[min(e.tokenIndex(), (toks.size()-1))];
+    support::io::LineIndex lines(source.data(), source.size());
+    string::size_type tline = lines.line(token.byte());
+    cout << compilename << ':' << tline+1 << ':' << lines.column(token.byte())+1 << ": " << e.what() << endl;
+
+    cout << "note: source context: " << compilename << ':' << tline+1 << endl;
+    for (string::size_type i = (tline > 0 ? (tline-1) : 0); i <= (tline+1) and i < lines.lines(); ++i) {
+        cout << ((i == tline) ? "->  " : "    ") << lines.text(i) << endl;
+    }
 }
 
 
+#ifndef PJAC_NO_MAIN
 int main(int argc, char **argv) {
     // setup command line arguments vector
     vector<string> args;
+    bool streaming = false;
+    bool report_registers = false;
+    bool report_peephole = false;
+    bool time_passes = false;
+    bool only_reachable = false;
+    // functions compiled along with those reachable from main() if only reachable functions are compiled
+    vector<string> exported;
+    unsigned jobs = thread::hardware_concurrency();
+    PassManager passes;
 
     for (int i = 1; i < argc; ++i) {
-        args.push_back(string(argv[i]));
+        string arg(argv[i]);
+        if (arg == "--stream") {
+            streaming = true;
+        } else if (arg == "--report-registers") {
+            report_registers = true;
+        } else if (arg == "--report-peephole") {
+            report_peephole = true;
+        } else if (support::str::startswith(arg, "--jobs=")) {
+            if (not support::str::isnum(arg.substr(7), false) or stoul(arg.substr(7)) == 0) {
+                cout << "fatal: invalid number of jobs: " << arg.substr(7) << endl;
+                return 1;
+            }
+            jobs = static_cast<unsigned>(stoul(arg.substr(7)));
+        } else if (arg == "--reachable") {
+            only_reachable = true;
+        } else if (support::str::startswith(arg, "--export=")) {
+            if (arg.size() == 9) {
+                cout << "fatal: no function name given to --export" << endl;
+                return 1;
+            }
+            exported.push_back(arg.substr(9));
+        } else if (support::str::startswith(arg, "--inline-limit=")) {
+            if (not support::str::isnum(arg.substr(15), false)) {
+                cout << "fatal: invalid inline limit: " << arg.substr(15) << endl;
+                return 1;
+            }
+            passes.inline_limit = static_cast<unsigned>(stoul(arg.substr(15)));
+        } else if (support::str::startswith(arg, "--no-inline=")) {
+            if (arg.size() == 12) {
+                cout << "fatal: no function name given to --no-inline" << endl;
+                return 1;
+            }
+            passes.exclude(arg.substr(12));
+        } else if (arg == "--time-passes") {
+            time_passes = true;
+        } else if (support::str::startswith(arg, "-O")) {
+            if (arg.size() != 3 or not support::str::isnum(arg.substr(2), false) or stoul(arg.substr(2)) > PassManager::max_level) {
+                cout << "fatal: invalid optimisation level: " << arg << endl;
+                return 1;
+            }
+            passes.level(static_cast<unsigned>(stoul(arg.substr(2))));
+        } else if (support::str::startswith(arg, "-f") and arg.size() > 2) {
+            bool enabled = (not support::str::startswith(arg, "-fno-"));
+            string name = arg.substr(enabled ? 2 : 5);
+            if (not passes.enable(name, enabled)) {
+                cout << "fatal: no such pass: " << name << endl;
+                return 1;
+            }
+        } else {
+            args.push_back(arg);
+        }
     }
 
     string filename(""), compilename("");
@@ -1898,7 +5614,7 @@ int main(int argc, char **argv) {
         cout << "fatal: no file to assemble" << endl;
         return 1;
     }
-    if (!support::env::isfile(filename)) {
+    if (filename != "-" and not (support::env::isfile(filename) or support::env::isstream(filename))) {
         cout << "fatal: no such file: " << filename << endl;
         return 1;
     }
@@ -1906,38 +5622,79 @@ int main(int argc, char **argv) {
     if (args.size() == 2) {
         compilename = args[1];
     }
+    if (compilename == "" and filename == "-") {
+        cout << "fatal: output file must be given when compiling standard input" << endl;
+        return 1;
+    }
     if (compilename == "") {
         compilename = (filename + ".asm");
     }
 
-    string source_text = support::io::readfile(filename);
+    support::io::MappedFile source(filename);
+    Interner symbols;
+
+    // tokens keep 32-bit offsets into the source
+    if (source.size() > numeric_limits<uint32_t>::max()) {
+        cout << "fatal: source too large: " << filename << " (" << source.size() << " bytes)" << endl;
+        return 1;
+    }
+
+    string::size_type invalid = support::utf8::validate(source.data(), source.size());
+    if (invalid != string::npos) {
+        support::io::LineIndex lines(source.data(), source.size());
+        cout << "fatal: invalid UTF-8 in " << filename << ':' << lines.line(invalid)+1 << ':' << lines.column(invalid)+1 << endl;
+        return 1;
+    }
+
+    // finding reachable functions needs the whole token stream
+    if (streaming and not only_reachable) {
+        TokenVector window(source.data(), source.size(), symbols);
+        ofstream compile_output(compilename);
+        bool compiled = false;
+        // held back until compilation succeeds, a fallback would report every function twice
+        ostringstream reports;
+        try {
+            compiled = processSourceStreaming(source.data(), source.size(), window, compile_output, (report_registers ? &reports : nullptr), &passes, (report_peephole ? &reports : nullptr));
+        } catch (const InvalidSyntax& e) {
+            // do not leave partial output behind
+            compile_output.close();
+            remove(compilename.c_str());
+            reportSyntaxError(e, window, compilename, source);
+            return 1;
+        } catch (...) {
+            compile_output.close();
+            remove(compilename.c_str());
+            throw;
+        }
+        if (compiled) {
+            cout << reports.str();
+            if (time_passes) {
+                passes.report(cout);
+            }
+            return 0;
+        }
+        // fall back to compiling the whole token stream at once
+        compile_output.close();
+        remove(compilename.c_str());
+        passes.clearTimes();
+    }
 
-    auto primitive_toks = support::str::lex(source_text);
-    auto toks = reduceVariableLengthOperator(reduceNamespacedNames(reduceNamespaceResolutionOperator(reduceFloats(reduceIntegers(removeNewlines(removeComments(primitive_toks)))))));
+    auto primitive_toks = support::str::lex(source.data(), source.size(), symbols, jobs);
+    auto toks = normalize(primitive_toks);
 
     ostringstream out;
     try {
-        processSource(toks, out);
+        processSource(toks, out, (report_registers ? &cout : nullptr), &passes, (report_peephole ? &cout : nullptr), (only_reachable ? &exported : nullptr));
         ofstream compile_output(compilename);
         compile_output << out.str();
     } catch (const InvalidSyntax& e) {
-        cout << compilename << ':' << toks[e.tokenIndex()].line()+1 << ':' << toks[e.tokenIndex()].character()+1 << ": " << e.what() << endl;
-
-        cout << "note: source context: " << compilename << ':' << toks[e.tokenIndex()].line()+1 << endl;
-        istringstream in(source_text);
-        string line;
-        int i = 0, tline = toks[e.tokenIndex()].line();
-        while (getline(in, line)) {
-            if (i >= tline-1 and i <= tline+1) {
-                cout << ((i == tline) ? "->  " : "    ") << line << endl;
-            }
-            if (i == tline+1) {
-                break;
-            }
-            ++i;
-        }
+        reportSyntaxError(e, toks, compilename, source);
         return 1;
     }
+    if (time_passes) {
+        passes.report(cout);
+    }
 
     return 0;
 }
+#endif